@@ -0,0 +1,155 @@
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include <opencv2/core.hpp>
+
+#include "src/inference_backend.h"
+
+const std::string ProgramName { "FaceBackendBench" };
+const std::string CommandLineParams =
+    "{ help h usage ?    |      | print this message }"
+    "{ detector_onnx     |   ../../data/yolov5s-face.onnx   | detection model for opencv, openvino and onnxruntime backends }"
+    "{ detector_torchscript |   | detection model for torch backend (skipped if empty) }"
+    "{ recognizer_onnx   |      | recognition model for opencv, openvino and onnxruntime backends (skipped if empty) }"
+    "{ recognizer_torchscript | ../../data/adaface_ir18_vgg2.torchscript | recognition model for torch backend }"
+    "{ backends          | opencv,openvino,torch,onnxruntime | comma-separated backends to compare }"
+    "{ batch             |   16     | recognition model batch size }"
+    "{ threads           |   0      | intra-op threads (0 - backend default) }"
+    "{ warmup            |   3      | untimed runs per model and backend }"
+    "{ runs              |   20     | timed runs per model and backend }"
+    ;
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct ModelCase
+{
+    std::string name;
+    std::string onnxPath;
+    std::string torchScriptPath;
+    cv::Mat blob;
+};
+
+std::vector<std::string> parseList(const std::string& str)
+{
+    std::vector<std::string> result;
+    std::stringstream ss(str);
+    for (std::string item; std::getline(ss, item, ',');)
+        if (!item.empty())
+            result.push_back(item);
+    return result;
+}
+
+cv::Mat randomBlob(int batch, int channels, cv::Size size, std::mt19937& rng)
+{
+    const int sizes[4] = { batch, channels, size.height, size.width };
+    cv::Mat blob(4, sizes, CV_32F);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::generate(blob.ptr<float>(), blob.ptr<float>() + blob.total(), [&]() { return uniform(rng); });
+    return blob;
+}
+
+/* Max absolute difference of the first outputs, backends must agree on the model contract */
+double maxAbsDiff(const cv::Mat& a, const cv::Mat& b)
+{
+    if (a.total() != b.total())
+        return -1.0;
+    return cv::norm(a.reshape(1, 1), b.reshape(1, 1), cv::NORM_INF);
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    /* Check and parse cmd args */
+    cv::CommandLineParser parser(argc, argv, CommandLineParams);
+    parser.about(ProgramName);
+    if (parser.has("help"))
+    {
+        parser.printMessage();
+        return EXIT_SUCCESS;
+    }
+    if (!parser.check())
+    {
+        parser.printErrors();
+        return EXIT_FAILURE;
+    }
+    const auto batch = std::max(1, parser.get<int>("batch"));
+    const auto nWarmup = parser.get<int>("warmup");
+    const auto nRuns = std::max(1, parser.get<int>("runs"));
+    std::vector<InferenceBackend::Type> backends;
+    try
+    {
+        for (const auto& name : parseList(parser.get<std::string>("backends")))
+            backends.push_back(InferenceBackend::parseType(name));
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    InferenceBackend::Options options;
+    options.intraOpThreads = parser.get<int>("threads");
+    options.interOpThreads = 1;
+
+    std::mt19937 rng(42);
+    const std::vector<ModelCase> models = {
+        { "detector", parser.get<std::string>("detector_onnx"), parser.get<std::string>("detector_torchscript"),
+            randomBlob(1, 3, { 640, 640 }, rng) },
+        { "recognizer", parser.get<std::string>("recognizer_onnx"), parser.get<std::string>("recognizer_torchscript"),
+            randomBlob(batch, 3, { 112, 112 }, rng) }
+    };
+
+    std::cout << "model        backend        ms/run    max|diff| vs first" << std::endl;
+    for (const auto& model : models)
+    {
+        cv::Mat reference;
+        for (const auto type : backends)
+        {
+            const auto& modelpath = (InferenceBackend::needsTorchScript(type)) ? model.torchScriptPath : model.onnxPath;
+            if (modelpath.empty() || !InferenceBackend::isAvailable(type))
+                continue;
+
+            std::unique_ptr<InferenceBackend> backend;
+            std::vector<cv::Mat> outputs;
+            double ms = 0.0;
+            try
+            {
+                backend = InferenceBackend::create(type, modelpath, options);
+                for (int run = 0; run < nWarmup; ++run)
+                    backend->infer(model.blob, outputs);
+
+                const auto start = Clock::now();
+                for (int run = 0; run < nRuns; ++run)
+                    backend->infer(model.blob, outputs);
+                ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / nRuns;
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << model.name << " / " << InferenceBackend::typeName(type) << " failed:\n" << e.what() << std::endl;
+                continue;
+            }
+            if (outputs.empty())
+                continue;
+
+            std::string diff = "-";
+            if (reference.empty())
+                reference = outputs[0].clone();
+            else
+                diff = cv::format("%.6f", maxAbsDiff(reference, outputs[0]));
+            std::cout << cv::format("%-12s %-12s %8.3f    %s",
+                model.name.c_str(), InferenceBackend::typeName(type), ms, diff.c_str()) << std::endl;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -1,4 +1,9 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fstream>
 #include <cstdlib>
+#include <memory>
 #include <iostream>
 #include <unordered_map>
 #include <filesystem>
@@ -12,12 +17,31 @@ namespace fs = std::filesystem;
 #include "src/face_detector.h"
 #include "src/face_extractor.h"
 #include "src/math.h"
+#include "src/gallery.h"
+#include "src/simd.h"
+#include "src/enrollment_manifest.h"
+#include "src/blocking_queue.h"
 
 const std::string ProgramName { "FaceCollector" };
 const std::string CommandLineParams =
     "{ help h usage ?    |      | print this message }"
     "{ @input i          |      | path to input photos }"
-    "{ @output o         |      | path to output file with embeddings }"
+    "{ @output o         |      | path to output file with embeddings (.xml/.yml/.json for cv::FileStorage, otherwise memory-mappable binary) }"
+    "{ precision         |   f32    | additionally store quantized gallery copy in binary output: f32 (none), f16, int8 }"
+    "{ exemplars         |   0      | exemplar embeddings kept per person besides the average (0 keeps only the average) }"
+    "{ incremental       |          | process only photos added or changed since the previous run, drop removed ones }"
+    "{ manifest          |          | path to processed photos manifest (default: <output>.manifest.yml) }"
+    "{ workers           |   0      | photo decoding and face detection threads (0 - number of cores) }"
+    "{ batch             |   32     | faces per embedding extraction batch }"
+    "{ detector_backend  |   opencv | detection model runtime: opencv, openvino, torch, onnxruntime }"
+    "{ detector_input    |   640    | detection model input long side (multiple of 32, e.g. 320 for large faces) }"
+    "{ letterbox         |   1      | keep frame aspect ratio in detection input (0 - stretch to square) }"
+    "{ detector_dynamic  |   0      | letterbox to the frame aspect ratio instead of a square (model must accept dynamic shapes) }"
+    "{ recognizer_backend |  torch  | recognition model runtime: opencv, openvino, torch, onnxruntime (model file must match) }"
+    "{ calibration_dir   |          | write face crops as the extractor sees them (input for int8 model calibration) }"
+    "{ calibration_size  |   512    | max number of calibration crops }"
+    "{ check_precision   |   f32    | also run extractor in bf16 or int8 and report cosine agreement with f32 embeddings (f32 - off) }"
+    "{ check_recognizer_path |      | model for -check_precision (default: recognizer_path; int8 needs a quantized model) }"
     "{ @detector_path d  |   ../../data/yolov5s-face.onnx   | path to face detection model }"
     "{ @recognizer_path r|   ../../data/adaface_ir18_vgg2.torchscript   | path to face recognition model }"
     ;
@@ -43,6 +67,13 @@ int main(int argc, char *argv[])
     const auto output = parser.get<std::string>("@output");
     const auto detectorPath = parser.get<std::string>("@detector_path");
     const auto recognizerPath = parser.get<std::string>("@recognizer_path");
+    const auto nExemplars = parser.get<int>("exemplars");
+    const bool incremental = parser.has("incremental");
+    auto manifestPath = parser.get<std::string>("manifest");
+    auto nWorkers = parser.get<int>("workers");
+    const auto batchSize = std::max(1, parser.get<int>("batch"));
+    if (nWorkers <= 0)
+        nWorkers = std::max(1u, std::thread::hardware_concurrency());
 
     if (input.empty())
     {
@@ -54,21 +85,86 @@ int main(int argc, char *argv[])
         std::cerr << "You must specify -output" << std::endl;
         return EXIT_FAILURE;
     }
+    if (manifestPath.empty())
+        manifestPath = output + ".manifest.yml";
+
+    /* Manifest of the previous run: photos which did not change are not processed again */
+    EnrollmentManifest previousManifest;
+    if (incremental && fs::exists(manifestPath))
+    {
+        try
+        {
+            previousManifest = EnrollmentManifest::load(manifestPath);
+        }
+        catch(const std::exception& e)
+        {
+            std::cerr << "Failed to read -manifest:\n" << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "Loaded " << previousManifest.entries().size() << " processed photos from manifest" << std::endl;
+    }
     
     /* Initialize general stuff */
-    FaceDetector faceDetector(detectorPath);
-    FaceExtractor faceExtractor(recognizerPath);
+    FaceExtractor::Config extractorConfig;
+    extractorConfig.maxBatchSize = batchSize;
+    FaceDetector::Config detectorConfig;
+    detectorConfig.inputSize = parser.get<int>("detector_input");
+    detectorConfig.letterbox = static_cast<bool>(parser.get<int>("letterbox"));
+    detectorConfig.dynamicInput = static_cast<bool>(parser.get<int>("detector_dynamic"));
+    try
+    {
+        detectorConfig.backend = InferenceBackend::parseType(parser.get<std::string>("detector_backend"));
+        extractorConfig.backend = InferenceBackend::parseType(parser.get<std::string>("recognizer_backend"));
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    FaceExtractor faceExtractor(recognizerPath, extractorConfig);
 
-    /* Iterate over input directory and extracting embeddings from internal photos */
-    cv::FileStorage fileStorage(output, cv::FileStorage::WRITE);
-    std::vector<std::string> personNames;
+    /* Reduced precision extractor whose embeddings are compared with the float32 ones */
+    std::unique_ptr<FaceExtractor> checkExtractor;
+    try
+    {
+        extractorConfig.precision = FaceExtractor::parsePrecision(parser.get<std::string>("check_precision"));
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (FaceExtractor::Precision::Float32 != extractorConfig.precision)
+    {
+        auto checkRecognizerPath = parser.get<std::string>("check_recognizer_path");
+        if (checkRecognizerPath.empty())
+            checkRecognizerPath = recognizerPath;
+        checkExtractor = std::make_unique<FaceExtractor>(checkRecognizerPath, extractorConfig);
+    }
+
+    const auto calibrationDir = parser.get<std::string>("calibration_dir");
+    const auto calibrationSize = parser.get<int>("calibration_size");
+    if (!calibrationDir.empty())
+        fs::create_directories(calibrationDir);
+    if (nWorkers > 1)
+        cv::setNumThreads(1); // detection workers already occupy the cores
+
+    /* Enumerate photos: the ones with the same size and mtime as in the manifest are not processed again */
+    struct PhotoJob
+    {
+        std::string key; // path relative to the input directory
+        fs::path path;
+        EnrollmentManifest::Entry entry;
+    };
+    EnrollmentManifest manifest;
+    std::vector<PhotoJob> jobs;
+    int nReused = 0;
     for (const auto& personDirEntry : fs::directory_iterator(input))
     {
         if (!fs::is_directory(personDirEntry))
             continue;
 
         const auto personName = personDirEntry.path().filename().string();
-        std::vector<std::vector<float>> personEmbeddings;
         for (const auto & personPhotosEntry : fs::directory_iterator(personDirEntry))
         {
             if (!fs::is_regular_file(personPhotosEntry))
@@ -78,41 +174,228 @@ int main(int argc, char *argv[])
             if (!(ext == ".png" || ext == ".jpg" || ext == ".jpeg"))
                 continue;
 
-            const auto photoAbsPath = fs::absolute(personPhotosEntry.path()).string();
-            const cv::Mat photo = cv::imread(photoAbsPath);
-            if (photo.empty())
-                continue;
+            PhotoJob job;
+            job.key = fs::relative(personPhotosEntry.path(), input).generic_string();
+            job.path = fs::absolute(personPhotosEntry.path());
+            job.entry.person = personName;
+            job.entry.size = personPhotosEntry.file_size();
+            job.entry.mtime = personPhotosEntry.last_write_time().time_since_epoch().count();
 
-            const auto faceDetectionResults = faceDetector.detect(photo);
-            if (faceDetectionResults.empty())
+            const auto* previous = previousManifest.find(job.key);
+            if (previous && previous->person == personName
+                && previous->size == job.entry.size && previous->mtime == job.entry.mtime)
+            {
+                manifest.set(job.key, *previous);
+                ++nReused;
                 continue;
+            }
+            jobs.emplace_back(std::move(job));
+        }
+    }
+    std::cout << "Photos to process: " << jobs.size() << ", workers: " << nWorkers << std::endl;
 
-            const auto& faceBoundingBox = faceDetectionResults[0].boundingBox;
-            const auto faceCrop = photo(faceBoundingBox);
-            auto faceEmbedding = faceExtractor.extract(faceCrop);
-            if (faceEmbedding.empty())
-                continue;
+    /* Pipeline: workers read, hash, decode and detect -> bounded queue -> batched extraction on this thread */
+    enum class PhotoStatus { Detected, Reused, Unreadable };
+    struct DetectedPhoto
+    {
+        std::string key;
+        EnrollmentManifest::Entry entry;
+        PhotoStatus status { PhotoStatus::Unreadable };
+        cv::Mat faceCrop; // empty if no face was found
+    };
+    BlockingQueue<DetectedPhoto> detectedPhotos(4 * batchSize);
+    std::atomic<int> nextJob { 0 };
+    std::atomic<int> nActiveWorkers { nWorkers };
+    std::vector<std::thread> workers;
+    for (int w = 0; w < nWorkers; ++w)
+    {
+        workers.emplace_back([&]()
+        {
+            FaceDetector faceDetector(detectorPath, detectorConfig); // backends are not thread-safe: one per worker
+            for (int j = nextJob++; j < static_cast<int>(jobs.size()); j = nextJob++)
+            {
+                auto& job = jobs[j];
+                DetectedPhoto detected { job.key, std::move(job.entry) };
+                try
+                {
+                    /* File is read once: content hash is taken from the same buffer the photo is decoded from */
+                    std::ifstream in(job.path, std::ios::binary);
+                    std::vector<unsigned char> buffer(detected.entry.size);
+                    if (!in.read(reinterpret_cast<char*>(buffer.data()), buffer.size()))
+                        throw std::runtime_error("Could not read " + job.path.string());
+                    detected.entry.hash = EnrollmentManifest::hashBytes(buffer.data(), buffer.size());
 
-            personEmbeddings.emplace_back(std::move(faceEmbedding));
+                    const auto* previous = previousManifest.find(job.key);
+                    if (previous && previous->person == detected.entry.person && previous->hash == detected.entry.hash)
+                    {
+                        detected.entry.embedding = previous->embedding;
+                        detected.status = PhotoStatus::Reused;
+                    }
+                    else
+                    {
+                        const cv::Mat photo = cv::imdecode(buffer, cv::IMREAD_COLOR);
+                        if (!photo.empty())
+                        {
+                            const auto faceDetectionResults = faceDetector.detect(photo);
+                            if (!faceDetectionResults.empty())
+                                detected.faceCrop = photo(faceDetectionResults[0].boundingBox).clone();
+                            detected.status = PhotoStatus::Detected;
+                        }
+                    }
+                }
+                catch(const std::exception& e)
+                {
+                    std::cerr << "Failed to process " << job.key << ":\n" << e.what() << std::endl;
+                }
+                detectedPhotos.push(std::move(detected));
+            }
+            if (0 == --nActiveWorkers)
+                detectedPhotos.close();
+        });
+    }
+
+    std::vector<std::string> batchKeys;
+    std::vector<EnrollmentManifest::Entry> batchEntries;
+    std::vector<cv::Mat> batchCrops;
+    cv::Mat batchEmbeddings;
+    cv::Mat checkEmbeddings;
+    int nCalibrationCrops = 0;
+    int nChecked = 0;
+    double sumCheckCosine = 0.0;
+    float minCheckCosine = 1.0f;
+    const auto extractBatch = [&]()
+    {
+        if (batchCrops.empty())
+            return;
+        faceExtractor.extract(batchCrops, batchEmbeddings);
+        if (checkExtractor)
+        {
+            checkExtractor->extract(batchCrops, checkEmbeddings);
+            for (int i = 0; i < batchEmbeddings.rows; ++i)
+            {
+                const auto cosine = static_cast<float>(
+                    batchEmbeddings.row(i).dot(checkEmbeddings.row(i))
+                    / (cv::norm(batchEmbeddings.row(i)) * cv::norm(checkEmbeddings.row(i)) + 1e-6));
+                sumCheckCosine += cosine;
+                minCheckCosine = std::min(minCheckCosine, cosine);
+                ++nChecked;
+            }
         }
 
-        /* Write embedding to disk */
+        for (std::size_t i = 0; i < batchCrops.size(); ++i)
+        {
+            if (!calibrationDir.empty() && nCalibrationCrops < calibrationSize)
+            {
+                cv::Mat calibrationCrop;
+                cv::resize(batchCrops[i], calibrationCrop, FaceExtractor::InputSize, 0.0, 0.0, cv::INTER_CUBIC);
+                cv::imwrite((fs::path(calibrationDir) / (std::to_string(nCalibrationCrops++) + ".png")).string(), calibrationCrop);
+            }
+
+            batchEntries[i].embedding.assign(batchEmbeddings.ptr<float>(i), batchEmbeddings.ptr<float>(i) + batchEmbeddings.cols);
+            // unit length like the embeddings reused from the manifest, so both average alike
+            simdNormalize(batchEntries[i].embedding.data(), batchEntries[i].embedding.size());
+            manifest.set(batchKeys[i], std::move(batchEntries[i]));
+        }
+        batchKeys.clear();
+        batchEntries.clear();
+        batchCrops.clear();
+    };
+
+    int nProcessed = 0;
+    const auto start = std::chrono::steady_clock::now();
+    const auto elapsedSeconds = [&start]()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    while (auto detected = detectedPhotos.pop())
+    {
+        if (PhotoStatus::Unreadable == detected->status)
+            continue;
+        if (PhotoStatus::Reused == detected->status)
+        {
+            manifest.set(detected->key, std::move(detected->entry));
+            ++nReused;
+            continue;
+        }
+
+        if (detected->faceCrop.empty())
+        {
+            manifest.set(detected->key, std::move(detected->entry)); // photos without faces are recorded too
+        }
+        else
+        {
+            batchKeys.emplace_back(std::move(detected->key));
+            batchEntries.emplace_back(std::move(detected->entry));
+            batchCrops.emplace_back(std::move(detected->faceCrop));
+            if (static_cast<int>(batchCrops.size()) >= batchSize)
+                extractBatch();
+        }
+
+        if (0 == ++nProcessed % 1000)
+            std::cout << "Processed " << nProcessed << " / " << jobs.size() << " photos ("
+                << nProcessed / elapsedSeconds() << " photos/s)" << std::endl;
+    }
+    extractBatch();
+    for (auto& worker : workers)
+        worker.join();
+
+    const double seconds = elapsedSeconds();
+    std::cout << "Processed " << nProcessed << " photos in " << seconds << " s ("
+        << ((seconds > 0.0) ? nProcessed / seconds : 0.0) << " photos/s)" << std::endl;
+
+    if (nChecked > 0)
+        std::cout << "Extractor " << parser.get<std::string>("check_precision") << " vs f32 cosine agreement over "
+            << nChecked << " faces: mean " << sumCheckCosine / nChecked << ", min " << minCheckCosine << std::endl;
+
+    int nRemoved = 0;
+    for (const auto& [photoKey, previous] : previousManifest.entries())
+        nRemoved += (nullptr == manifest.find(photoKey));
+    std::cout << "Photos processed: " << nProcessed << ", unchanged: " << nReused << ", removed: " << nRemoved << std::endl;
+
+    /* Group embeddings by person: manifest entries are ordered by path, so one person's photos are adjacent */
+    std::vector<std::string> personNames;
+    Matr personAvgEmbeddings;
+    std::vector<Matr> personExemplars;
+    const auto& entries = manifest.entries();
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+        const auto& personName = it->second.person;
+        Matr personEmbeddings;
+        for (; it != entries.end() && it->second.person == personName; ++it)
+            if (!it->second.embedding.empty())
+                personEmbeddings.push_back(it->second.embedding);
+
         if (personEmbeddings.size() > 0)
         {
-            const auto personAvgEmbedding = avgEmbedding(personEmbeddings);
-            fileStorage << personName 
-                << cv::Mat(1, personAvgEmbedding.size(), CV_32F, (void*)personAvgEmbedding.data());
+            personAvgEmbeddings.emplace_back(avgEmbedding(personEmbeddings));
+            if (nExemplars > 0)
+                personExemplars.emplace_back(selectExemplars(personEmbeddings, nExemplars));
             personNames.emplace_back(personName);
 
             std::cout << "Embeddings extracted for " << personName << std::endl;
         }
     }
-    if (personNames.size() > 0)
+
+    /* Write embeddings to disk */
+    try
+    {
+        Gallery gallery(std::move(personNames), personAvgEmbeddings, personExemplars);
+        gallery.setPrecision(Gallery::parsePrecision(parser.get<std::string>("precision")));
+        gallery.save(output);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Failed to write -output:\n" << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    try
+    {
+        manifest.save(manifestPath);
+    }
+    catch(const std::exception& e)
     {
-        fileStorage << "Names" << "[";
-        for (const auto& name : personNames)
-            fileStorage << name;
-        fileStorage << "]";
+        std::cerr << "Failed to write -manifest:\n" << e.what() << std::endl;
+        return EXIT_FAILURE;
     }
 
     std::cout << "Program successfully finished" << std::endl;
@@ -1,4 +1,8 @@
+#include <chrono>
+#include <future>
+#include <memory>
 #include <cstdlib>
+#include <algorithm>
 #include <iostream>
 #include <filesystem>
 namespace fs = std::filesystem;
@@ -12,7 +16,9 @@ namespace fs = std::filesystem;
 #include "src/face_extractor.h"
 #include "src/renderer.h"
 #include "src/math.h"
+#include "src/gallery.h"
 #include "src/face.h"
+#include "src/motion_gate.h"
 
 const std::string ProgramName { "FaceRecognizer" };
 const std::string CommandLineParams =
@@ -28,7 +34,36 @@ const std::string CommandLineParams =
     "{ conf              |   0.25   | minimal detection confidence }"
     "{ sim_thr           |   0.25   | minimal similarity }"
     "{ gpu               |   0      | enable gpu }"
+    "{ detector_backend  |   opencv | detection model runtime: opencv, openvino, torch, onnxruntime }"
+    "{ detector_input    |   640    | detection model input long side (multiple of 32, e.g. 320 for large faces) }"
+    "{ letterbox         |   1      | keep frame aspect ratio in detection input (0 - stretch to square) }"
+    "{ detector_dynamic  |   0      | letterbox to the frame aspect ratio instead of a square (model must accept dynamic shapes) }"
+    "{ detect_batch      |   1      | frames read ahead and detected in one pass (video files; model must accept dynamic batch) }"
+    "{ tiled             |   0      | detect on overlapping tiles merged with cross-tile NMS (small faces on 4K frames) }"
+    "{ tile_size         |   960    | tile side in frame pixels }"
+    "{ tile_overlap      |   0.2    | min overlap of neighbouring tiles, fraction of tile_size }"
+    "{ tile_batch        |   0      | tiles per detection pass, 0 - all tiles of a frame (model must accept dynamic batch) }"
+    "{ motion_gate       |   0      | skip detection on static frames, detect only where something moved }"
+    "{ motion_threshold  |   16     | gray level change counted as motion }"
+    "{ motion_full_frame |   5000   | with motion_gate, search the whole frame at least this often, msec }"
+    "{ recognizer_backend |  torch  | recognition model runtime: opencv, openvino, torch, onnxruntime (model file must match) }"
+    "{ extractor_precision | f32    | recognition model precision on CPU: f32, bf16, int8 (recognizer_path must be a quantized model) }"
+    "{ extract_batch     |   16     | max faces per embedding extraction pass }"
+    "{ torch_threads     |   0      | recognition model intra-op threads (0 - backend default) }"
+    "{ warmup            |   2      | extractor warm-up passes per batch shape before the first frame }"
+    "{ model_cache       |          | directory for optimized models reused by later runs (empty - off) }"
     "{ input_scale       |   1.0    | input resolution scale }"
+    "{ index             |   exact  | gallery search backend: exact, hnsw }"
+    "{ index_file        |          | path to hnsw graph (built from -persons_file and saved there if missing or stale) }"
+    "{ hnsw_m            |   16     | hnsw links per node }"
+    "{ hnsw_ef_construction | 200   | hnsw candidate list size while building }"
+    "{ hnsw_ef           |   64     | hnsw candidate list size while searching (recall/speed trade-off) }"
+    "{ top_k             |   1      | number of best gallery candidates kept per face }"
+    "{ certain_sim       |   0      | stop gallery scan once this similarity is reached (0 - scan whole gallery) }"
+    "{ gallery_precision |   f32    | exact search first pass precision: f32, f16, int8 }"
+    "{ rerank            |   32     | number of f16/int8 first pass candidates re-ranked in f32 }"
+    "{ exemplar_shortlist |  8      | best centroid matches whose exemplars are checked (0 - centroids only) }"
+    "{ search_threads    |   1      | threads sharing one gallery search (keep within cores left by the models) }"
     ;
 
 int main(int argc, char *argv[])
@@ -56,50 +91,127 @@ int main(int argc, char *argv[])
     const auto minSimilarity = parser.get<float>("sim_thr");
     const auto enableGpu = static_cast<bool>(parser.get<int>("gpu"));
     const auto inputScale = parser.get<float>("input_scale");
+    const auto topK = std::max(1, parser.get<int>("top_k"));
+    const auto certainSimilarity = (parser.get<float>("certain_sim") > 0.0f) 
+        ? parser.get<float>("certain_sim") : Gallery::NeverCertain;
+    const auto modelCache = parser.get<std::string>("model_cache");
+    const auto galleryIndex = parser.get<std::string>("index");
+    const auto indexFile = parser.get<std::string>("index_file");
     
+    /* Load models in background while the gallery is prepared and the video is opened */
+    FaceDetector::Config detectorConfig;
+    detectorConfig.enableGpu = enableGpu;
+    detectorConfig.cacheDir = modelCache;
+    detectorConfig.inputSize = parser.get<int>("detector_input");
+    detectorConfig.letterbox = static_cast<bool>(parser.get<int>("letterbox"));
+    detectorConfig.dynamicInput = static_cast<bool>(parser.get<int>("detector_dynamic"));
+    detectorConfig.maxBatchSize = std::max(1, parser.get<int>("detect_batch"));
+    detectorConfig.tileSize = parser.get<int>("tile_size");
+    detectorConfig.tileOverlap = parser.get<float>("tile_overlap");
+    detectorConfig.tileBatchSize = std::max(0, parser.get<int>("tile_batch"));
+    const auto tiled = static_cast<bool>(parser.get<int>("tiled"));
+    const auto motionGating = static_cast<bool>(parser.get<int>("motion_gate"));
+    MotionGate::Params motionGateParams;
+    motionGateParams.pixelThreshold = parser.get<int>("motion_threshold");
+    motionGateParams.fullFrameEveryMs = parser.get<int>("motion_full_frame");
+    FaceExtractor::Config extractorConfig;
+    extractorConfig.enableGpu = enableGpu;
+    extractorConfig.cacheDir = modelCache;
+    try
+    {
+        detectorConfig.backend = InferenceBackend::parseType(parser.get<std::string>("detector_backend"));
+        extractorConfig.backend = InferenceBackend::parseType(parser.get<std::string>("recognizer_backend"));
+        extractorConfig.precision = FaceExtractor::parsePrecision(parser.get<std::string>("extractor_precision"));
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    extractorConfig.maxBatchSize = parser.get<int>("extract_batch");
+    extractorConfig.intraOpThreads = parser.get<int>("torch_threads");
+    extractorConfig.interOpThreads = 1; // one model call at a time
+    extractorConfig.warmupRuns = parser.get<int>("warmup");
+    const auto loadingStart = std::chrono::steady_clock::now();
+    auto detectorLoading = std::async(std::launch::async, [&detectorPath, detectorConfig, tiled]()
+    {
+        auto detector = std::make_unique<FaceDetector>(detectorPath, detectorConfig);
+        // batched modes need a dynamic batch dimension: fail now rather than on the first frame
+        if (detectorConfig.maxBatchSize > 1)
+            detector->checkInput(detectorConfig.maxBatchSize, detectorConfig.inputSize);
+        if (tiled && 1 != detectorConfig.tileBatchSize)
+            detector->checkInput(2, detectorConfig.inputSize);
+        return detector;
+    });
+    auto extractorLoading = std::async(std::launch::async, [&recognizerPath, extractorConfig]()
+        { return std::make_unique<FaceExtractor>(recognizerPath, extractorConfig); });
+
     /* Fetch existing embeddings from disk */
-    std::vector<std::string> personNames;
-    Matr personEmbeddings;
+    Gallery gallery;
     if (!personsFile.empty())
     {
-        cv::FileStorage personsFileStorage;
         try
         {
-            personsFileStorage.open(personsFile, cv::FileStorage::READ);
-            if (!personsFileStorage.isOpened())
-            {
-                std::cerr << "Failed to open -persons_file" << std::endl;
-                return EXIT_FAILURE;
-            }
+            gallery = Gallery::load(personsFile);
         }
-        catch(const cv::Exception& e)
+        catch(const std::exception& e)
         {
-            std::cerr << "Failed to open -persons_file:\n" << e.what() << std::endl;
+            std::cerr << "Failed to read -persons_file:\n" << e.what() << std::endl;
             return EXIT_FAILURE;
         }
-        const auto personNamesNode = personsFileStorage["Names"];
-        if (cv::FileNode::SEQ != personNamesNode.type())
+        std::cout << "Loaded " << gallery.size() << " persons from disk" << std::endl;
+
+        try
         {
-            std::cerr << "Failed to read names from -persons_file. Data invalid." << std::endl;
+            gallery.setPrecision(
+                Gallery::parsePrecision(parser.get<std::string>("gallery_precision")), parser.get<int>("rerank"));
+            gallery.setExemplarShortlist(parser.get<int>("exemplar_shortlist"));
+            gallery.setSearchThreads(parser.get<int>("search_threads"));
+        }
+        catch(const std::exception& e)
+        {
+            std::cerr << "Failed to set -gallery_precision:\n" << e.what() << std::endl;
             return EXIT_FAILURE;
         }
 
-        for (auto it = personNamesNode.begin(); it != personNamesNode.end(); ++it)
-            personNames.emplace_back(static_cast<std::string>(*it));
-        personEmbeddings.reserve(personNames.size());
-        for (const auto& name : personNames)
+        if ("hnsw" == galleryIndex && !gallery.empty())
         {
-            cv::Mat embeddingMat;
-            personsFileStorage[name] >> embeddingMat;
-            std::vector<float> embedding(embeddingMat.begin<float>(), embeddingMat.end<float>());
-            personEmbeddings.emplace_back(std::move(embedding));
+            try
+            {
+                const bool indexFresh = !indexFile.empty() && fs::exists(indexFile)
+                    && fs::last_write_time(indexFile) >= fs::last_write_time(personsFile);
+                bool indexLoaded = false;
+                if (indexFresh)
+                {
+                    try
+                    {
+                        gallery.loadIndex(indexFile);
+                        indexLoaded = true;
+                    }
+                    catch(const std::exception& e)
+                    {
+                        std::cerr << "Could not load hnsw index, rebuilding it:\n" << e.what() << std::endl;
+                    }
+                }
+                if (!indexLoaded)
+                {
+                    HnswIndex::Params hnswParams;
+                    hnswParams.M = parser.get<int>("hnsw_m");
+                    hnswParams.efConstruction = parser.get<int>("hnsw_ef_construction");
+                    gallery.buildIndex(hnswParams);
+                    if (!indexFile.empty())
+                        gallery.saveIndex(indexFile);
+                }
+                gallery.setEfSearch(parser.get<int>("hnsw_ef"));
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << "Failed to prepare hnsw index:\n" << e.what() << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::cout << "Using hnsw gallery index" << std::endl;
         }
-        std::cout << "Loaded " << personEmbeddings.size() << " persons from disk" << std::endl;
     }
-    
-    /* Initialize general stuff */
-    FaceDetector faceDetector(detectorPath, enableGpu);
-    FaceExtractor faceExtractor(recognizerPath, enableGpu);
 
     /* Capture input */
     cv::VideoCapture capture;
@@ -113,22 +225,98 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    /* Wait for models */
+    std::unique_ptr<FaceDetector> faceDetectorModel;
+    try
+    {
+        faceDetectorModel = detectorLoading.get();
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    const auto faceExtractorModel = extractorLoading.get();
+    FaceDetector& faceDetector = *faceDetectorModel;
+    FaceExtractor& faceExtractor = *faceExtractorModel;
+    std::cout << "Models ready in " << std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - loadingStart).count() << " ms" << std::endl;
+
     /* Start main loop */
+    std::vector<cv::Mat> frameBatch;    // frames read ahead, detected in one pass
+    std::vector<std::vector<FaceDetector::DetectionResult>> batchDetectionResults; // reused between batches
+    std::size_t batchPos = 0;
+    const int readAhead = (tiled || motionGating) ? 1 : detectorConfig.maxBatchSize; // tiled mode batches tiles of one frame instead
+    MotionGate motionGate(motionGateParams);
+    std::vector<FaceDetector::DetectionResult> regionDetectionResults;
+    const auto bigBang = std::chrono::steady_clock::now();
+    cv::Mat faceEmbeddings;
+    cv::Mat alignedFaceEmbeddings;
     std::int64_t frameNum = 1;
     for (;; ++frameNum)
     {
-        cv::Mat frame;
-        capture >> frame;
-        if (frame.empty())
-            break;
+        if (batchPos == frameBatch.size())
+        {
+            frameBatch.clear();
+            for (int i = 0; i < readAhead; ++i)
+            {
+                cv::Mat frame;
+                capture >> frame;
+                if (frame.empty())
+                    break;
+                if (1.0 != inputScale)
+                    cv::resize(frame, frame, cv::Size(), inputScale, inputScale);
+                frameBatch.push_back(std::move(frame));
+            }
+            if (frameBatch.empty())
+                break;
 
-        if (1.0 != inputScale)
-            cv::resize(frame, frame, cv::Size(), inputScale, inputScale);
+            /* NN magic */
 
-        /* NN magic */
+            // 1. Detect faces (on all frames read ahead at once, or on one frame: tile by tile, where something moved)
+            if (tiled || motionGating)
+            {
+                batchDetectionResults.resize(1);
+                auto& detections = batchDetectionResults[0]; // detections of the previous frame until replaced
+                const cv::Rect frameRect(cv::Point(), frameBatch[0].size());
+                cv::Rect region = frameRect;
+                if (motionGating)
+                {
+                    const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - bigBang).count();
+                    region = (motionGate.update(frameBatch[0], now)) ? motionGate.region() : cv::Rect();
+                }
 
-        // 1. Detect faces
-        const auto faceDetectionResults = faceDetector.detect(frame, minConfidence);
+                if (region == frameRect)
+                {
+                    if (tiled)
+                        faceDetector.detectTiled(frameBatch[0], detections, minConfidence);
+                    else
+                        faceDetector.detect(frameBatch[0], detections, minConfidence);
+                }
+                else if (!region.empty())
+                {
+                    // faces outside the moving region did not move: their previous detections stay
+                    if (tiled)
+                        faceDetector.detectTiled(frameBatch[0], region, regionDetectionResults, minConfidence);
+                    else
+                        faceDetector.detect(frameBatch[0], region, regionDetectionResults, minConfidence);
+                    detections.erase(std::remove_if(detections.begin(), detections.end(),
+                        [&region](const auto& detection) { return (detection.boundingBox & region).area() > 0; }),
+                        detections.end());
+                    detections.insert(detections.end(), regionDetectionResults.begin(), regionDetectionResults.end());
+                }
+                // static frame: previous detections stay valid
+            }
+            else
+            {
+                faceDetector.detect(frameBatch, batchDetectionResults, minConfidence);
+            }
+            batchPos = 0;
+        }
+        cv::Mat& frame = frameBatch[batchPos];
+        const auto& faceDetectionResults = batchDetectionResults[batchPos];
+        ++batchPos;
 
         std::vector<Face> faces;
         faces.reserve(faceDetectionResults.size());
@@ -143,34 +331,56 @@ int main(int argc, char *argv[])
                 -1.0f
                 );
         
-        // 2. Extract face embeddings and identify them
+        // 2. Extract face embeddings and identify them (all faces of the frame at once)
+
+        // 2.1. Extract & idenfity (try #1)
+        std::vector<cv::Mat> faceCrops;
+        faceCrops.reserve(faces.size());
+        for (const auto& face : faces)
+            faceCrops.push_back(face.crop);
+        faceExtractor.extract(faceCrops, faceEmbeddings);
+        auto candidates = gallery.searchBatchTopK(faceEmbeddings, topK, certainSimilarity);
+
+        // 2.2. Extract & idenfity (try #2 on aligned faces) if the first try failed
+        std::vector<int> retryIds;
+        std::vector<cv::Mat> alignedFaceCrops;
         for (int i = 0; i < faces.size(); ++i)
         {
-            // 2.1. Extract & idenfity (try #1)
-            auto faceEmbedding = faceExtractor.extract(faces[i].crop);
-            auto [bestId, bestSim] = searchMostSimilarEmbedding(personEmbeddings, faceEmbedding);
+            if (!candidates[i].empty() && minSimilarity <= candidates[i][0].second)
+                continue;
 
-            // 2.3. Extract & idenfity (try #2 on aligned face) if the first try failed
-            if (minSimilarity > bestSim)
-            {
-                const cv::Mat alignedFaceCrop = alignFace2(
-                    frame, 
-                    faces.at(i).boundingBox, 
-                    faces.at(i).landmarks, 
-                    FaceExtractor::InputSize, 
-                    FaceExtractor::ReferencePoints3);
-
-                faceEmbedding = faceExtractor.extract(alignedFaceCrop);
-                std::tie(bestId, bestSim) = searchMostSimilarEmbedding(personEmbeddings, faceEmbedding);
-
-                faces[i].rotatedBoundingBox = getFaceRotatedBoundingBox(
-                    frame, faces.at(i).boundingBox, faces.at(i).landmarks, FaceExtractor::ReferencePoints3);
-            }
+            alignedFaceCrops.push_back(alignFace2(
+                frame, 
+                faces.at(i).boundingBox, 
+                *faces.at(i).landmarks, 
+                FaceExtractor::InputSize, 
+                FaceExtractor::ReferencePoints3));
+            retryIds.push_back(i);
+
+            faces[i].rotatedBoundingBox = getFaceRotatedBoundingBox(
+                frame, faces.at(i).boundingBox, *faces.at(i).landmarks, FaceExtractor::ReferencePoints3);
+        }
+        if (!retryIds.empty())
+        {
+            faceExtractor.extract(alignedFaceCrops, alignedFaceEmbeddings);
+            const auto retryCandidates = gallery.searchBatchTopK(alignedFaceEmbeddings, topK, certainSimilarity);
+            for (int j = 0; j < retryIds.size(); ++j)
+                candidates[retryIds[j]] = retryCandidates[j];
+        }
+
+        for (int i = 0; i < faces.size(); ++i)
+        {
+            if (candidates[i].empty())
+                continue;
+
+            for (const auto& [candidateId, candidateSim] : candidates[i])
+                faces[i].candidates.emplace_back(gallery.name(candidateId), candidateSim);
 
+            const auto [bestId, bestSim] = candidates[i][0];
             if (bestSim >= minSimilarity)
             {
                 faces[i].nameId = bestId;
-                faces[i].name = personNames[bestId];
+                faces[i].name = gallery.name(bestId);
                 faces[i].similarity = bestSim;
             }
         }
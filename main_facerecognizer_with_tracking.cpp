@@ -1,4 +1,7 @@
 #include <chrono>
+#include <cmath>
+#include <future>
+#include <memory>
 #include <cstdlib>
 #include <iostream>
 #include <algorithm>
@@ -15,6 +18,9 @@ namespace fs = std::filesystem;
 #include "src/box_tracker.h"
 #include "src/renderer.h"
 #include "src/math.h"
+#include "src/gallery.h"
+#include "src/embedding_cache.h"
+#include "src/motion_gate.h"
 #include "src/face.h"
 
 constexpr float DetectionNoise { 0.1f };
@@ -33,8 +39,41 @@ const std::string CommandLineParams =
     "{ conf              |   0.25   | minimal detection confidence }"
     "{ sim_thr           |   0.25   | minimal similarity }"
     "{ gpu               |   0      | enable gpu }"
+    "{ detector_backend  |   opencv | detection model runtime: opencv, openvino, torch, onnxruntime }"
+    "{ detector_input    |   640    | detection model input long side (multiple of 32, e.g. 320 for large faces) }"
+    "{ letterbox         |   1      | keep frame aspect ratio in detection input (0 - stretch to square) }"
+    "{ detector_dynamic  |   0      | letterbox to the frame aspect ratio instead of a square (model must accept dynamic shapes) }"
+    "{ recognizer_backend |  torch  | recognition model runtime: opencv, openvino, torch, onnxruntime (model file must match) }"
+    "{ extractor_precision | f32    | recognition model precision on CPU: f32, bf16, int8 (recognizer_path must be a quantized model) }"
+    "{ extract_batch     |   16     | max faces per embedding extraction pass }"
+    "{ torch_threads     |   0      | recognition model intra-op threads (0 - backend default) }"
+    "{ warmup            |   2      | extractor warm-up passes per batch shape before the first frame }"
+    "{ model_cache       |          | directory for optimized models reused by later runs (empty - off) }"
     "{ input_scale       |   1.0    | input resolution scale }"
+    "{ index             |   exact  | gallery search backend: exact, hnsw }"
+    "{ index_file        |          | path to hnsw graph (built from -persons_file and saved there if missing or stale) }"
+    "{ hnsw_m            |   16     | hnsw links per node }"
+    "{ hnsw_ef_construction | 200   | hnsw candidate list size while building }"
+    "{ hnsw_ef           |   64     | hnsw candidate list size while searching (recall/speed trade-off) }"
+    "{ certain_sim       |   0      | stop gallery scan once this similarity is reached (0 - scan whole gallery) }"
+    "{ gallery_precision |   f32    | exact search first pass precision: f32, f16, int8 }"
+    "{ rerank            |   32     | number of f16/int8 first pass candidates re-ranked in f32 }"
+    "{ exemplar_shortlist |  8      | best centroid matches whose exemplars are checked (0 - centroids only) }"
+    "{ search_threads    |   1      | threads sharing one gallery search (keep within cores left by the models) }"
     "{ detection_freq    |   500    | detection frequency msec }"
+    "{ adaptive_detection |  0      | pick detection period from tracker uncertainty and detector load (detection_freq while nothing is tracked) }"
+    "{ detection_freq_min |  50     | with adaptive_detection, shortest detection period msec }"
+    "{ detection_freq_max |  2000   | with adaptive_detection, longest detection period msec }"
+    "{ target_fps        |   25     | with adaptive_detection, frame rate to hold }"
+    "{ detection_budget  |   0.5    | with adaptive_detection, max share of frame time spent in detection }"
+    "{ roi_detection     |   0      | between full-frame detections, detect only around the tracker prediction }"
+    "{ roi_scale         |   2.0    | region around the predicted box searched by roi_detection, in box sizes }"
+    "{ roi_input         |   192    | detection model input long side for roi_detection with detector_dynamic, otherwise detector_input }"
+    "{ motion_gate       |   0      | skip triggered detection on static frames, detect only where something moved }"
+    "{ motion_threshold  |   16     | gray level change counted as motion }"
+    "{ motion_full_frame |   5000   | with motion_gate, search the whole frame at least this often, msec }"
+    "{ cache_timeout     |   1000   | reuse embedding of a stable track for this many msec (0 - extract every frame) }"
+    "{ cache_hash_distance | 12     | crop difference hash bits allowed to change before the embedding is refreshed }"
     ;
 
 int main(int argc, char *argv[])
@@ -62,46 +101,129 @@ int main(int argc, char *argv[])
     const auto minSimilarity = parser.get<float>("sim_thr");
     const auto enableGpu = static_cast<bool>(parser.get<int>("gpu"));
     const auto inputScale = parser.get<float>("input_scale");
+    const auto certainSimilarity = (parser.get<float>("certain_sim") > 0.0f) 
+        ? parser.get<float>("certain_sim") : Gallery::NeverCertain;
+    const auto modelCache = parser.get<std::string>("model_cache");
+    const auto galleryIndex = parser.get<std::string>("index");
+    const auto indexFile = parser.get<std::string>("index_file");
     const auto detectionFrequency = static_cast<std::int64_t>(parser.get<int>("detection_freq"));
+    const auto adaptiveDetection = static_cast<bool>(parser.get<int>("adaptive_detection"));
+    AdaptiveTrigger::Params adaptiveTriggerParams;
+    adaptiveTriggerParams.basePeriodMs = detectionFrequency;
+    adaptiveTriggerParams.minPeriodMs = parser.get<int>("detection_freq_min");
+    adaptiveTriggerParams.maxPeriodMs = parser.get<int>("detection_freq_max");
+    adaptiveTriggerParams.targetFps = parser.get<float>("target_fps");
+    adaptiveTriggerParams.cpuBudget = parser.get<float>("detection_budget");
+    const auto roiDetection = static_cast<bool>(parser.get<int>("roi_detection"));
+    const auto roiScale = parser.get<float>("roi_scale");
+    const auto motionGating = static_cast<bool>(parser.get<int>("motion_gate"));
+    MotionGate::Params motionGateParams;
+    motionGateParams.pixelThreshold = parser.get<int>("motion_threshold");
+    motionGateParams.fullFrameEveryMs = parser.get<int>("motion_full_frame");
     
+    /* Load models in background while the gallery is prepared and the video is opened */
+    FaceDetector::Config detectorConfig;
+    detectorConfig.enableGpu = enableGpu;
+    detectorConfig.cacheDir = modelCache;
+    detectorConfig.inputSize = parser.get<int>("detector_input");
+    detectorConfig.letterbox = static_cast<bool>(parser.get<int>("letterbox"));
+    detectorConfig.dynamicInput = static_cast<bool>(parser.get<int>("detector_dynamic"));
+    detectorConfig.roiInputSize = parser.get<int>("roi_input");
+    FaceExtractor::Config extractorConfig;
+    extractorConfig.enableGpu = enableGpu;
+    extractorConfig.cacheDir = modelCache;
+    try
+    {
+        detectorConfig.backend = InferenceBackend::parseType(parser.get<std::string>("detector_backend"));
+        extractorConfig.backend = InferenceBackend::parseType(parser.get<std::string>("recognizer_backend"));
+        extractorConfig.precision = FaceExtractor::parsePrecision(parser.get<std::string>("extractor_precision"));
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    extractorConfig.maxBatchSize = parser.get<int>("extract_batch");
+    extractorConfig.intraOpThreads = parser.get<int>("torch_threads");
+    extractorConfig.interOpThreads = 1; // one model call at a time
+    extractorConfig.warmupRuns = parser.get<int>("warmup");
+    const auto loadingStart = std::chrono::steady_clock::now();
+    auto detectorLoading = std::async(std::launch::async, [&detectorPath, detectorConfig, roiDetection]()
+    {
+        auto detector = std::make_unique<FaceDetector>(detectorPath, detectorConfig);
+        // region passes run at roi_input: fail now rather than on the first tracked frame
+        if (roiDetection && detectorConfig.dynamicInput)
+            detector->checkInput(1, detectorConfig.roiInputSize);
+        return detector;
+    });
+    auto extractorLoading = std::async(std::launch::async, [&recognizerPath, extractorConfig]()
+        { return std::make_unique<FaceExtractor>(recognizerPath, extractorConfig); });
+
     /* Fetch existing embeddings from disk */
-    std::vector<std::string> personNames;
-    Matr personEmbeddings;
+    Gallery gallery;
     if (!personsFile.empty())
     {
-        cv::FileStorage personsFileStorage;
         try
         {
-            personsFileStorage.open(personsFile, cv::FileStorage::READ);
-            if (!personsFileStorage.isOpened())
-            {
-                std::cerr << "Failed to open -persons_file" << std::endl;
-                return EXIT_FAILURE;
-            }
+            gallery = Gallery::load(personsFile);
         }
-        catch(const cv::Exception& e)
+        catch(const std::exception& e)
         {
-            std::cerr << "Failed to open -persons_file:\n" << e.what() << std::endl;
+            std::cerr << "Failed to read -persons_file:\n" << e.what() << std::endl;
             return EXIT_FAILURE;
         }
-        const auto personNamesNode = personsFileStorage["Names"];
-        if (cv::FileNode::SEQ != personNamesNode.type())
+        std::cout << "Loaded " << gallery.size() << " persons from disk" << std::endl;
+
+        try
+        {
+            gallery.setPrecision(
+                Gallery::parsePrecision(parser.get<std::string>("gallery_precision")), parser.get<int>("rerank"));
+            gallery.setExemplarShortlist(parser.get<int>("exemplar_shortlist"));
+            gallery.setSearchThreads(parser.get<int>("search_threads"));
+        }
+        catch(const std::exception& e)
         {
-            std::cerr << "Failed to read names from -persons_file. Data invalid." << std::endl;
+            std::cerr << "Failed to set -gallery_precision:\n" << e.what() << std::endl;
             return EXIT_FAILURE;
         }
 
-        for (auto it = personNamesNode.begin(); it != personNamesNode.end(); ++it)
-            personNames.emplace_back(static_cast<std::string>(*it));
-        personEmbeddings.reserve(personNames.size());
-        for (const auto& name : personNames)
+        if ("hnsw" == galleryIndex && !gallery.empty())
         {
-            cv::Mat embeddingMat;
-            personsFileStorage[name] >> embeddingMat;
-            std::vector<float> embedding(embeddingMat.begin<float>(), embeddingMat.end<float>());
-            personEmbeddings.emplace_back(std::move(embedding));
+            try
+            {
+                const bool indexFresh = !indexFile.empty() && fs::exists(indexFile)
+                    && fs::last_write_time(indexFile) >= fs::last_write_time(personsFile);
+                bool indexLoaded = false;
+                if (indexFresh)
+                {
+                    try
+                    {
+                        gallery.loadIndex(indexFile);
+                        indexLoaded = true;
+                    }
+                    catch(const std::exception& e)
+                    {
+                        std::cerr << "Could not load hnsw index, rebuilding it:\n" << e.what() << std::endl;
+                    }
+                }
+                if (!indexLoaded)
+                {
+                    HnswIndex::Params hnswParams;
+                    hnswParams.M = parser.get<int>("hnsw_m");
+                    hnswParams.efConstruction = parser.get<int>("hnsw_ef_construction");
+                    gallery.buildIndex(hnswParams);
+                    if (!indexFile.empty())
+                        gallery.saveIndex(indexFile);
+                }
+                gallery.setEfSearch(parser.get<int>("hnsw_ef"));
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << "Failed to prepare hnsw index:\n" << e.what() << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::cout << "Using hnsw gallery index" << std::endl;
         }
-        std::cout << "Loaded " << personEmbeddings.size() << " persons from disk" << std::endl;
     }
 
     /* Capture input */
@@ -125,16 +247,40 @@ int main(int argc, char *argv[])
     }
     
     /* Initialize general stuff */
-    FaceDetector faceDetector(detectorPath, enableGpu);
-    FaceExtractor faceExtractor(recognizerPath, enableGpu);
+    std::unique_ptr<FaceDetector> faceDetectorModel;
+    try
+    {
+        faceDetectorModel = detectorLoading.get();
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    const auto faceExtractorModel = extractorLoading.get();
+    FaceDetector& faceDetector = *faceDetectorModel;
+    FaceExtractor& faceExtractor = *faceExtractorModel;
+    std::cout << "Models ready in " << std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - loadingStart).count() << " ms" << std::endl;
     BoxTracker boxTracker(frame0.size(), DetectionNoise);
     PeriodicTrigger trigger(detectionFrequency);
+    AdaptiveTrigger adaptiveTrigger(adaptiveTriggerParams);
+    EmbeddingCache::Params cacheParams;
+    cacheParams.maxAgeMs = parser.get<int>("cache_timeout");
+    cacheParams.maxHashDistance = parser.get<int>("cache_hash_distance");
+    EmbeddingCache embeddingCache(cacheParams);
+    MotionGate motionGate(motionGateParams);
 
     /* Start main loop */
+    cv::Mat faceEmbeddings; // reused between frames
+    std::vector<cv::Rect> regions(1);
+    std::vector<std::vector<FaceDetector::DetectionResult>> regionDetectionResults;
+    std::vector<FaceDetector::DetectionResult> faceDetectionResults;
     const auto bigBang = std::chrono::system_clock::now();
     std::int64_t frameNum = 1;
     for (;; ++frameNum)
     {
+        const auto frameStart = std::chrono::steady_clock::now();
         cv::Mat frame;
         capture >> frame;
         if (frame.empty())
@@ -155,13 +301,30 @@ int main(int argc, char *argv[])
 
         // 1. Detect face with given frequency
         FaceDetector::DetectionResult faceDetectionResult;
-        const bool rocknroll = trigger.rocknroll(timestamp);
+        double detectionMs = 0.0;
+        bool rocknroll = (adaptiveDetection) ? adaptiveTrigger.rocknroll(timestamp) : trigger.rocknroll(timestamp);
+        if (rocknroll && motionGating)
+            rocknroll = motionGate.update(frame, timestamp); // static frame: tracker prediction is good enough
         if (rocknroll)
         {
-            const auto faceDetectionResults = faceDetector.detect(frame, minConfidence);
+            const auto region = (motionGating) ? motionGate.region() : cv::Rect(cv::Point(), frame.size());
+            const auto detectionStart = std::chrono::steady_clock::now();
+            faceDetector.detect(frame, region, faceDetectionResults, minConfidence);
+            detectionMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - detectionStart).count();
             if (faceDetectionResults.size() > 0)
                 faceDetectionResult = faceDetectionResults[0];
         }
+        else if (roiDetection && boxTracker.initialized())
+        {
+            // cheap pass on the region the tracked face is expected in: fresh box and landmarks every frame
+            regions[0] = expandRect(boxTracker.predicted(), roiScale, cv::Rect(cv::Point(), frame.size()));
+            if (!regions[0].empty())
+            {
+                faceDetector.detectRegions(frame, regions, regionDetectionResults, minConfidence);
+                if (!regionDetectionResults[0].empty())
+                    faceDetectionResult = regionDetectionResults[0][0];
+            }
+        }
 
         // 2. Keep tracking the face
         cv::Rect faceTracklet;
@@ -175,10 +338,28 @@ int main(int argc, char *argv[])
             faceTracklet = boxTracker.update(faceDetectionResult.boundingBox);
         }
 
+        if (faceTracklet.empty())
+        {
+            // track lost: drop its identity and fall back to the base detection period
+            embeddingCache.erase(0);
+            adaptiveTrigger.resetTrack();
+        }
+        else
+        {
+            // uncertain or fast track asks for the next detection sooner
+            const float boxSize = std::sqrt(static_cast<float>(faceTracklet.area()));
+            const auto velocity = boxTracker.velocity();
+            adaptiveTrigger.reportTrack(boxTracker.positionStdDev() / boxSize, std::hypot(velocity.x, velocity.y) / boxSize);
+        }
+
+        std::optional<Landmarks> faceLandmarks; // only fresh detections have landmarks
+        if (!faceDetectionResult.boundingBox.empty())
+            faceLandmarks = faceDetectionResult.landmarks;
+
         std::vector<Face> faces;
         faces.emplace_back(
             faceTracklet,
-            faceDetectionResult.landmarks,
+            faceLandmarks,
             faceDetectionResult.confidence,
             -1,
             "unknown",
@@ -187,11 +368,44 @@ int main(int argc, char *argv[])
             );
         auto& face = faces.at(0);
         
-        // 2. Extract face embedding and identify it
-        
-        // 2.1. Extract & idenfity (try #1)
-        auto faceEmbedding = faceExtractor.extract(face.crop);
-        auto [bestId, bestSim] = searchMostSimilarEmbedding(personEmbeddings, faceEmbedding);
+        // 2. Extract face embeddings and identify them
+
+        // 2.1. Reuse embeddings of stable tracks, extract & idenfity (try #1) the rest in one batch
+        const bool freshDetection = rocknroll && !faceDetectionResult.boundingBox.empty();
+        std::vector<Gallery::Match> matches(faces.size(), Gallery::Match{-1, -1.0f});
+        std::vector<std::uint64_t> cropHashes(faces.size());
+        std::vector<int> refreshIds;
+        std::vector<cv::Mat> faceCrops;
+        for (int i = 0; i < faces.size(); ++i) // track id is the face index
+        {
+            cropHashes[i] = EmbeddingCache::dHash(faces[i].crop);
+            const auto* cached = embeddingCache.find(i, cropHashes[i], freshDetection, timestamp);
+            if (cached)
+            {
+                matches[i] = cached->match;
+                continue;
+            }
+            refreshIds.push_back(i);
+            faceCrops.push_back(faces[i].crop);
+        }
+        if (!faceCrops.empty())
+        {
+            faceExtractor.extract(faceCrops, faceEmbeddings);
+            const auto refreshedMatches = gallery.searchBatchTopK(faceEmbeddings, 1, certainSimilarity);
+            for (int j = 0; j < refreshIds.size(); ++j)
+            {
+                const int i = refreshIds[j];
+                if (!refreshedMatches[j].empty())
+                    matches[i] = refreshedMatches[j][0];
+
+                EmbeddingCache::Entry entry;
+                entry.match = matches[i];
+                entry.cropHash = cropHashes[i];
+                entry.timestamp = timestamp;
+                embeddingCache.update(i, std::move(entry));
+            }
+        }
+        auto [bestId, bestSim] = matches.at(0);
 
         // // 2.3. Extract & idenfity (try #2 on aligned face) if the first try failed
         // if (minSimilarity > bestSim)
@@ -204,13 +418,13 @@ int main(int argc, char *argv[])
         //         FaceExtractor::ReferencePoints2);
 
         //     faceEmbedding = faceExtractor.extract(alignedFaceCrop);
-        //      std::tie(bestId, bestSim) = searchMostSimilarEmbedding(personEmbeddings, faceEmbedding);
+        //      std::tie(bestId, bestSim) = searchMostSimilarEmbedding(gallery, faceEmbedding);
         // }
 
         if (bestSim >= minSimilarity)
         {
             face.nameId = bestId;
-            face.name = personNames[bestId];
+            face.name = gallery.name(bestId);
             face.similarity = bestSim;
         }
 
@@ -223,6 +437,9 @@ int main(int argc, char *argv[])
         const auto key = static_cast<char>(cv::waitKey(15));
         if (27 == key || 'q' == key)
             break;
+
+        adaptiveTrigger.reportFrame(
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count(), detectionMs);
     }
 
     capture.release();
@@ -0,0 +1,192 @@
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include <opencv2/core.hpp>
+
+#include "src/gallery.h"
+#include "src/simd.h"
+
+const std::string ProgramName { "FaceGalleryBench" };
+const std::string CommandLineParams =
+    "{ help h usage ?    |      | print this message }"
+    "{ @persons_file p   |      | path to file with person embeddings (synthetic gallery is generated if empty) }"
+    "{ synthetic         | 100000 | synthetic gallery size }"
+    "{ dim               |   512  | synthetic embedding dimention }"
+    "{ queries           |   1000 | number of queries }"
+    "{ noise             |   0.03 | per-component gaussian noise added to gallery rows to make queries }"
+    "{ k                 |   10   | top-k size for recall@k }"
+    "{ rerank            |   32   | f16/int8 first pass candidates re-ranked in f32 }"
+    "{ threads           |   1    | threads sharing one search }"
+    "{ hnsw_m            |   16   | hnsw links per node }"
+    "{ hnsw_ef_construction | 200 | hnsw candidate list size while building }"
+    "{ ef_list           | 16,32,64,128,256 | comma-separated hnsw_ef values to compare }"
+    ;
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+double elapsedMs(Clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+std::vector<int> parseIntList(const std::string& str)
+{
+    std::vector<int> result;
+    std::stringstream ss(str);
+    for (std::string item; std::getline(ss, item, ',');)
+        if (!item.empty())
+            result.push_back(std::stoi(item));
+    return result;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    /* Check and parse cmd args */
+    cv::CommandLineParser parser(argc, argv, CommandLineParams);
+    parser.about(ProgramName);
+    if (parser.has("help"))
+    {
+        parser.printMessage();
+        return EXIT_SUCCESS;
+    }
+    if (!parser.check())
+    {
+        parser.printErrors();
+        return EXIT_FAILURE;
+    }
+    const auto personsFile = parser.get<std::string>("@persons_file");
+    const auto nSynthetic = parser.get<int>("synthetic");
+    const auto dim = parser.get<int>("dim");
+    const auto nQueries = parser.get<int>("queries");
+    const auto noise = parser.get<float>("noise");
+    const auto k = parser.get<int>("k");
+    const auto rerank = parser.get<int>("rerank");
+    const auto efList = parseIntList(parser.get<std::string>("ef_list"));
+
+    /* Prepare gallery */
+    std::mt19937 rng(42);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    Gallery gallery;
+    try
+    {
+        if (!personsFile.empty())
+        {
+            gallery = Gallery::load(personsFile);
+        }
+        else
+        {
+            std::vector<std::string> names(nSynthetic);
+            Matr embeddings(nSynthetic, std::vector<float>(dim));
+            for (int i = 0; i < nSynthetic; ++i)
+            {
+                names[i] = std::to_string(i);
+                std::generate(embeddings[i].begin(), embeddings[i].end(), [&]() { return gauss(rng); });
+            }
+            gallery = Gallery(std::move(names), embeddings);
+        }
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Failed to prepare gallery:\n" << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (gallery.empty())
+    {
+        std::cerr << "Empty gallery" << std::endl;
+        return EXIT_FAILURE;
+    }
+    gallery.setSearchThreads(parser.get<int>("threads"));
+    std::cout << "Gallery: " << gallery.size() << " x " << gallery.dim()
+        << ", kernels: " << simdKernelName() << ", threads: " << gallery.searchThreads() << std::endl;
+
+    /* Queries are noisy copies of random gallery rows */
+    Matr queries(nQueries, std::vector<float>(gallery.dim()));
+    std::uniform_int_distribution<int> randomRow(0, gallery.size() - 1);
+    for (auto& query : queries)
+    {
+        const float* row = gallery.embeddings().ptr<float>(randomRow(rng));
+        for (int j = 0; j < gallery.dim(); ++j)
+            query[j] = row[j] + noise * gauss(rng);
+    }
+    cv::Mat queriesMat(nQueries, gallery.dim(), CV_32F);
+    for (int i = 0; i < nQueries; ++i)
+        std::copy(queries[i].begin(), queries[i].end(), queriesMat.ptr<float>(i));
+
+    /* Exact scan: ground truth */
+    auto start = Clock::now();
+    std::vector<Gallery::Match> exactBest;
+    exactBest.reserve(nQueries);
+    for (const auto& query : queries)
+        exactBest.push_back(gallery.search(query));
+    const double exactMs = elapsedMs(start) / nQueries;
+
+    start = Clock::now();
+    const auto exactTopK = gallery.searchBatchTopK(queriesMat, k);
+    const double batchMs = elapsedMs(start) / nQueries;
+
+    /* Quantized first pass + f32 re-ranking */
+    std::vector<std::string> quantizedReport;
+    for (const auto precision : { Gallery::Precision::Float16, Gallery::Precision::Int8 })
+    {
+        gallery.setPrecision(precision, rerank);
+
+        int hits1 = 0;
+        start = Clock::now();
+        for (int q = 0; q < nQueries; ++q)
+            hits1 += (gallery.search(queries[q]).first == exactBest[q].first);
+        const double quantizedMs = elapsedMs(start) / nQueries;
+
+        quantizedReport.push_back(cv::format("exact %-8s %8.4f   %8.4f          -",
+            (Gallery::Precision::Int8 == precision) ? "int8" : "f16", quantizedMs, hits1 / static_cast<double>(nQueries)));
+    }
+    gallery.setPrecision(Gallery::Precision::Float32);
+
+    /* HNSW */
+    HnswIndex::Params hnswParams;
+    hnswParams.M = parser.get<int>("hnsw_m");
+    hnswParams.efConstruction = parser.get<int>("hnsw_ef_construction");
+    start = Clock::now();
+    gallery.buildIndex(hnswParams);
+    std::cout << "HNSW build: " << elapsedMs(start) / 1000.0 << " s" << std::endl << std::endl;
+
+    std::cout << "backend        ms/query   recall@1   recall@" << k << std::endl;
+    std::cout << cv::format("exact          %8.4f   %8.4f   %8.4f", exactMs, 1.0, 1.0) << std::endl;
+    std::cout << cv::format("exact batch    %8.4f   %8.4f   %8.4f", batchMs, 1.0, 1.0) << std::endl;
+    for (const auto& line : quantizedReport)
+        std::cout << line << std::endl;
+    for (const auto ef : efList)
+    {
+        gallery.setEfSearch(ef);
+
+        int hits1 = 0;
+        int hitsK = 0;
+        start = Clock::now();
+        const auto hnswTopK = gallery.searchBatchTopK(queriesMat, k);
+        const double hnswMs = elapsedMs(start) / nQueries;
+        for (int q = 0; q < nQueries; ++q)
+        {
+            if (!hnswTopK[q].empty() && hnswTopK[q][0].first == exactBest[q].first)
+                ++hits1;
+            for (const auto& match : hnswTopK[q])
+                hitsK += std::any_of(exactTopK[q].begin(), exactTopK[q].end(),
+                    [&match](const Gallery::Match& exact) { return exact.first == match.first; });
+        }
+
+        const double kk = std::min(k, gallery.size());
+        std::cout << cv::format("hnsw ef=%-5d  %8.4f   %8.4f   %8.4f",
+            ef, hnswMs, hits1 / static_cast<double>(nQueries), hitsK / (kk * nQueries)) << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
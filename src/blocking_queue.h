@@ -0,0 +1,71 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <condition_variable>
+
+/**
+ * @brief Bounded multi-producer multi-consumer FIFO between pipeline stages.
+ * push() blocks while the queue is full, so a slow consumer throttles producers and memory stays bounded.
+ */
+template<typename T>
+class BlockingQueue final
+{
+public:
+    explicit BlockingQueue(std::size_t capacity)
+        : m_capacity(capacity)
+    {}
+
+    /**
+     * @brief Returns false if the queue was closed and value was dropped.
+     */
+    bool push(T value)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notFull.wait(lock, [this]() { return m_closed || m_items.size() < m_capacity; });
+        if (m_closed)
+            return false;
+        m_items.push_back(std::move(value));
+        lock.unlock();
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Waits for the next value, returns std::nullopt once the queue is closed and drained.
+     */
+    std::optional<T> pop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notEmpty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+        if (m_items.empty())
+            return std::nullopt;
+        T value = std::move(m_items.front());
+        m_items.pop_front();
+        lock.unlock();
+        m_notFull.notify_one();
+        return value;
+    }
+
+    /**
+     * @brief No more values will be pushed: wakes up all waiting consumers.
+     */
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+private:
+    const std::size_t m_capacity;
+    std::deque<T> m_items;
+    std::mutex m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    bool m_closed { false };
+};
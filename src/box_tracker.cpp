@@ -1,3 +1,4 @@
+#include <cmath>
 #include <algorithm>
 #include "box_tracker.h"
 
@@ -76,6 +77,26 @@ cv::Rect BoxTracker::update(cv::Rect bbox)
     }
 }
 
+cv::Rect BoxTracker::predicted() const
+{
+    if (!m_initialized)
+        return cv::Rect();
+
+    const cv::Mat predState = m_kf.transitionMatrix * m_kf.statePost;
+    return to_xywh(predState, m_sceneRect);
+}
+
+cv::Point2f BoxTracker::velocity() const
+{
+    return cv::Point2f(m_kf.statePost.at<float>(4), m_kf.statePost.at<float>(5));
+}
+
+float BoxTracker::positionStdDev() const
+{
+    const auto& cov = m_kf.errorCovPost;
+    return std::sqrt(0.5f * (cov.at<float>(0, 0) + cov.at<float>(1, 1)));
+}
+
 bool BoxTracker::initialized() const noexcept
 {
     return m_initialized;
@@ -27,6 +27,21 @@ public:
 
     cv::Rect update(cv::Rect bbox = cv::Rect());
 
+    /**
+     * @brief Box the next update() will predict, without advancing the filter. Empty before init().
+     */
+    cv::Rect predicted() const;
+
+    /**
+     * @brief Estimated box center velocity, pixels per update().
+     */
+    cv::Point2f velocity() const;
+
+    /**
+     * @brief Standard deviation of the estimated box center, pixels. Grows while the box is only predicted.
+     */
+    float positionStdDev() const;
+
     bool initialized() const noexcept;
 
 private:
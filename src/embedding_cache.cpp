@@ -0,0 +1,66 @@
+#include <bitset>
+
+#include <opencv2/imgproc.hpp>
+
+#include "embedding_cache.h"
+
+std::uint64_t EmbeddingCache::dHash(const cv::Mat& image)
+{
+    if (image.empty())
+        return 0;
+
+    cv::Mat gray;
+    if (3 == image.channels())
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = image;
+    cv::Mat thumbnail;
+    cv::resize(gray, thumbnail, cv::Size(9, 8), 0.0, 0.0, cv::INTER_AREA);
+
+    std::uint64_t hash = 0;
+    for (int y = 0; y < thumbnail.rows; ++y)
+    {
+        const auto* row = thumbnail.ptr<std::uint8_t>(y);
+        for (int x = 0; x < 8; ++x)
+            hash = (hash << 1) | (row[x] < row[x + 1]);
+    }
+    return hash;
+}
+
+EmbeddingCache::EmbeddingCache()
+    : EmbeddingCache(Params())
+{}
+
+EmbeddingCache::EmbeddingCache(Params params)
+    : m_params(params)
+{}
+
+EmbeddingCache::~EmbeddingCache() = default;
+
+const EmbeddingCache::Entry* EmbeddingCache::find(
+    int trackId, std::uint64_t cropHash, bool freshDetection, std::int64_t now) const
+{
+    if (m_params.maxAgeMs <= 0 || (freshDetection && m_params.refreshOnDetection))
+        return nullptr;
+
+    const auto it = m_entries.find(trackId);
+    if (m_entries.end() == it)
+        return nullptr;
+
+    const auto& entry = it->second;
+    if (now - entry.timestamp > m_params.maxAgeMs)
+        return nullptr;
+    if (static_cast<int>(std::bitset<64>(entry.cropHash ^ cropHash).count()) > m_params.maxHashDistance)
+        return nullptr;
+    return &entry;
+}
+
+void EmbeddingCache::update(int trackId, Entry entry)
+{
+    m_entries[trackId] = std::move(entry);
+}
+
+void EmbeddingCache::erase(int trackId)
+{
+    m_entries.erase(trackId);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <unordered_map>
+
+#include <opencv2/core.hpp>
+
+/**
+ * @brief Last gallery match of every track.
+ * While a track is stable its face is not extracted again: the entry is refreshed only on a fresh detection,
+ * when the crop looks different (difference hash distance) or when the entry gets too old.
+ */
+class EmbeddingCache final
+{
+public:
+
+    struct Params
+    {
+        std::int64_t maxAgeMs { 1000 };     // entries older than this are refreshed, 0 disables the cache
+        int maxHashDistance { 12 };         // crops whose dHash differs in more bits are refreshed
+        bool refreshOnDetection { true };   // fresh detection (not a tracker prediction) refreshes the entry
+    };
+
+    struct Entry
+    {
+        std::pair<int, float> match { -1, -1.0f }; // gallery id, similarity
+        std::uint64_t cropHash { 0 };
+        std::int64_t timestamp { 0 };
+    };
+
+    /**
+     * @brief 64-bit difference hash: sign of horizontal gradients of 9x8 grayscale thumbnail.
+     * Robust to small shifts and lighting, changes with pose or occlusion.
+     */
+    static std::uint64_t dHash(const cv::Mat& image);
+
+    EmbeddingCache();
+    explicit EmbeddingCache(Params params);
+    ~EmbeddingCache();
+
+    /**
+     * @brief Cached entry still valid for the current crop of the track, nullptr if face must be extracted again.
+     */
+    const Entry* find(int trackId, std::uint64_t cropHash, bool freshDetection, std::int64_t now) const;
+
+    void update(int trackId, Entry entry);
+
+    /**
+     * @brief Forgets a lost track, so that its id can not hand its identity over to the next face.
+     */
+    void erase(int trackId);
+
+private:
+    Params m_params;
+    std::unordered_map<int, Entry> m_entries;
+};
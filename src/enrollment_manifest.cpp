@@ -0,0 +1,157 @@
+#include <set>
+#include <cstdio>
+#include <stdexcept>
+
+#include <opencv2/core.hpp>
+
+#include "enrollment_manifest.h"
+#include "gallery.h"
+#include "mapped_file.h"
+
+std::uint64_t EnrollmentManifest::hashBytes(const void* data, std::size_t size, std::uint64_t hash)
+{
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+fs::path EnrollmentManifest::embeddingsPath(const fs::path& manifestPath)
+{
+    return fs::path(manifestPath).concat(".embeddings");
+}
+
+EnrollmentManifest EnrollmentManifest::load(const fs::path& filepath)
+{
+    cv::FileStorage fileStorage;
+    try
+    {
+        fileStorage.open(filepath.string(), cv::FileStorage::READ);
+    }
+    catch(const cv::Exception& e)
+    {
+        throw std::runtime_error(std::string("EnrollmentManifest::load: ") + e.what());
+    }
+    if (!fileStorage.isOpened())
+        throw std::runtime_error("EnrollmentManifest::load: Could not open " + filepath.string());
+
+    const auto photosNode = fileStorage["Photos"];
+    if (cv::FileNode::SEQ != photosNode.type())
+        throw std::runtime_error("EnrollmentManifest::load: Failed to read photos. Data invalid.");
+
+    /* 64-bit values are stored as strings: cv::FileStorage integers are 32-bit */
+    EnrollmentManifest manifest;
+    std::set<std::string> faces; // photos with an embedding row
+    try
+    {
+        for (auto it = photosNode.begin(); it != photosNode.end(); ++it)
+        {
+            const auto& node = *it;
+            Entry entry;
+            entry.person = static_cast<std::string>(node["person"]);
+            entry.size = std::stoull(static_cast<std::string>(node["size"]));
+            entry.mtime = std::stoll(static_cast<std::string>(node["mtime"]));
+            entry.hash = std::stoull(static_cast<std::string>(node["hash"]), nullptr, 16);
+
+            const auto path = static_cast<std::string>(node["path"]);
+            if (0 != static_cast<int>(node["face"]))
+                faces.insert(path);
+            manifest.m_entries[path] = std::move(entry);
+        }
+    }
+    catch(const std::exception& e)
+    {
+        throw std::runtime_error(std::string("EnrollmentManifest::load: Data invalid. ") + e.what());
+    }
+
+    /* Embeddings are mapped rather than parsed: rows are named by photo path */
+    if (faces.empty())
+        return manifest;
+    const auto embeddingsFile = embeddingsPath(filepath);
+    const auto embeddings = (fs::exists(embeddingsFile)) ? Gallery::load(embeddingsFile) : Gallery();
+    for (int i = 0; i < embeddings.size(); ++i)
+    {
+        const auto it = manifest.m_entries.find(embeddings.name(i));
+        if (manifest.m_entries.end() == it || !faces.count(it->first))
+            continue; // photo not in this manifest: save() was interrupted after the embeddings were written
+        const float* row = embeddings.embeddings().ptr<float>(i);
+        it->second.embedding.assign(row, row + embeddings.dim());
+    }
+
+    /* Photos whose embedding is missing are forgotten, so that the next run processes them again */
+    for (auto it = manifest.m_entries.begin(); it != manifest.m_entries.end();)
+    {
+        if (faces.count(it->first) && it->second.embedding.empty())
+            it = manifest.m_entries.erase(it);
+        else
+            ++it;
+    }
+    return manifest;
+}
+
+EnrollmentManifest::EnrollmentManifest() = default;
+
+EnrollmentManifest::~EnrollmentManifest() = default;
+
+void EnrollmentManifest::save(const fs::path& filepath) const
+{
+    /* Embeddings first: a manifest is only ever published after the rows it refers to */
+    std::vector<std::string> photoPaths;
+    Matr embeddings;
+    for (const auto& [path, entry] : m_entries)
+    {
+        if (entry.embedding.empty())
+            continue;
+        photoPaths.push_back(path);
+        embeddings.push_back(entry.embedding);
+    }
+    Gallery(std::move(photoPaths), embeddings).save(embeddingsPath(filepath));
+
+    /* Then the records, also renamed into place: an interrupted save leaves the previous manifest intact */
+    replaceFile(filepath, [this, &filepath](const fs::path& tmpPath)
+    {
+        // temporary file has no meaningful extension, keep the format of the target
+        const auto ext = filepath.extension();
+        const int format = (".xml" == ext) ? cv::FileStorage::FORMAT_XML
+            : (".json" == ext) ? cv::FileStorage::FORMAT_JSON : cv::FileStorage::FORMAT_YAML;
+        cv::FileStorage fileStorage(tmpPath.string(), cv::FileStorage::WRITE | format);
+        if (!fileStorage.isOpened())
+            throw std::runtime_error("EnrollmentManifest::save: Could not open " + filepath.string());
+
+        char hash[17];
+        fileStorage << "Photos" << "[";
+        for (const auto& [path, entry] : m_entries)
+        {
+            std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(entry.hash));
+            fileStorage << "{"
+                << "path" << path
+                << "person" << entry.person
+                << "size" << std::to_string(entry.size)
+                << "mtime" << std::to_string(entry.mtime)
+                << "hash" << std::string(hash)
+                << "face" << static_cast<int>(!entry.embedding.empty())
+                << "}";
+        }
+        fileStorage << "]";
+        fileStorage.release();
+    });
+}
+
+const EnrollmentManifest::Entry* EnrollmentManifest::find(const std::string& photoPath) const
+{
+    const auto it = m_entries.find(photoPath);
+    return (m_entries.end() == it) ? nullptr : &it->second;
+}
+
+void EnrollmentManifest::set(const std::string& photoPath, Entry entry)
+{
+    m_entries[photoPath] = std::move(entry);
+}
+
+const std::map<std::string, EnrollmentManifest::Entry>& EnrollmentManifest::entries() const noexcept
+{
+    return m_entries;
+}
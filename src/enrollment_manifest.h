@@ -0,0 +1,65 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+/**
+ * @brief Record of photos already processed by FaceCollector: per photo size, mtime, content hash
+ * and extracted embedding. Lets incremental enrollment skip unchanged photos and rebuild the gallery
+ * from stored embeddings. Photo records are written as cv::FileStorage, embeddings go to a separate
+ * memory-mapped binary gallery file (see embeddingsPath()) with one unit-length row per photo.
+ */
+class EnrollmentManifest final
+{
+public:
+
+    struct Entry
+    {
+        std::string person;
+        std::uint64_t size { 0 };
+        std::int64_t mtime { 0 };
+        std::uint64_t hash { 0 };
+        std::vector<float> embedding; // unit length, empty if no face was found on the photo
+    };
+
+    static constexpr std::uint64_t HashSeed { 14695981039346656037ull };
+
+    /**
+     * @brief 64-bit FNV-1a hash of a memory buffer, continues from hash for chunked input.
+     */
+    static std::uint64_t hashBytes(const void* data, std::size_t size, std::uint64_t hash = HashSeed);
+
+    /**
+     * @brief Binary embeddings file stored next to the manifest.
+     */
+    static fs::path embeddingsPath(const fs::path& manifestPath);
+
+    /**
+     * @brief Reads manifest and its embeddings file written by save(). Photos whose embedding is missing
+     * from the embeddings file are left out, so they are processed again. Throws std::runtime_error on invalid file.
+     */
+    static EnrollmentManifest load(const fs::path& filepath);
+
+    EnrollmentManifest();
+    ~EnrollmentManifest();
+
+    void save(const fs::path& filepath) const;
+
+    /**
+     * @brief Entry of the photo at path relative to the input directory, nullptr if not recorded.
+     */
+    const Entry* find(const std::string& photoPath) const;
+    void set(const std::string& photoPath, Entry entry);
+
+    /**
+     * @brief Entries ordered by photo path, so photos of one person are adjacent.
+     */
+    const std::map<std::string, Entry>& entries() const noexcept;
+
+private:
+    std::map<std::string, Entry> m_entries;
+};
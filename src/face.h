@@ -2,30 +2,34 @@
 
 #include <string>
 #include <vector>
+#include <utility>
+#include <optional>
 #include <opencv2/core/types.hpp>
+#include "math.h"
 
 struct Face final
 {
     cv::Rect boundingBox;
-    std::vector<int> landmarks;
+    std::optional<Landmarks> landmarks; // only fresh detections have landmarks, tracker predictions do not
     float confidence;
     int nameId;
     std::string name;
     float similarity;
     cv::Mat crop;
     cv::RotatedRect rotatedBoundingBox;
+    std::vector<std::pair<std::string, float>> candidates; // best gallery matches: name, similarity
 
     Face() = default;
     Face(
         cv::Rect boundingBox, 
-        std::vector<int> landmarks, 
+        std::optional<Landmarks> landmarks, 
         float confidence, 
         int nameId, 
         std::string name, 
         cv::Mat crop, 
         float similarity)
             : boundingBox(boundingBox)
-            , landmarks(std::move(landmarks))
+            , landmarks(landmarks)
             , confidence(confidence)
             , nameId(nameId)
             , name(std::move(name))
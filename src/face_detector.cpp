@@ -1,8 +1,14 @@
 #include <cmath>
+#include <numeric>
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 
+#include <opencv2/dnn.hpp>
+#include <opencv2/imgproc.hpp>
+
 #include "face_detector.h"
+#include "simd.h"
 
 namespace
 {
@@ -10,7 +16,12 @@ namespace
 constexpr double InputScale { 1.0 / 255.0 };
 constexpr float NmsThreshold { 0.25f };
 constexpr int cellDimention { 16 }; // xmin, ymin, xamx, ymax, box_score, x1, y1, ... ,x5, y5, face_score
-const cv::Size InputSize { 640, 640 };
+const cv::Scalar PadColor { 114, 114, 114 }; // YOLOv5 letterbox fill
+
+int alignUp(int value, int alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
 
 }
 
@@ -26,92 +37,377 @@ FaceDetector::DetectionResult::~DetectionResult() = default;
 
 
 FaceDetector::FaceDetector(const fs::path& modelpath, bool enableGpu)
+    : FaceDetector(modelpath, Config { enableGpu })
+{}
+
+FaceDetector::FaceDetector(const fs::path& modelpath, const Config& config)
+    : m_config(config)
 {
+    m_config.inputSize = alignUp(std::max(m_config.inputSize, Stride), Stride);
+    m_config.roiInputSize = alignUp(std::max(m_config.roiInputSize, Stride), Stride);
+    if (m_config.maxBatchSize < 1)
+        throw std::runtime_error("FaceDetector: maxBatchSize must be positive");
+    if (m_config.tileBatchSize < 0)
+        throw std::runtime_error("FaceDetector: tileBatchSize must not be negative");
+
+    InferenceBackend::Options options;
+    options.enableGpu = config.enableGpu;
+    options.cacheDir = config.cacheDir;
     try
     {
-        m_model = cv::dnn::readNet(modelpath.string());
-        if (enableGpu) // dummy-style without checking GPU availability.
-        {
-            m_model.setPreferableBackend(cv::dnn::DNN_BACKEND_CUDA);
-            m_model.setPreferableTarget(cv::dnn::DNN_TARGET_CUDA);
-        }
-        m_unconnectedLayersNames = m_model.getUnconnectedOutLayersNames();
+        m_backend = InferenceBackend::create(config.backend, modelpath, options);
     }
-    catch(const cv::Exception& e)
+    catch(const std::exception& e)
     {
         std::cerr << "FaceDetector: Could not read model:\n" << e.what() << std::endl;
     }
-    catch(...)
-    {
-        std::cerr << "FaceDetector: Could not read model: unknown error." << std::endl;
-    }
 }
 FaceDetector::~FaceDetector() = default;
 
 std::vector<FaceDetector::DetectionResult>
 FaceDetector::detect(const cv::Mat& image, float minConfidence)
+{
+    std::vector<DetectionResult> result;
+    detect(image, result, minConfidence);
+    return result;
+}
+
+void FaceDetector::detect(const cv::Mat& image, std::vector<DetectionResult>& detections, float minConfidence)
+{
+    detectBatch(&image, 1, m_config.inputSize, &detections, minConfidence);
+}
+
+void FaceDetector::detect(const std::vector<cv::Mat>& images, std::vector<std::vector<DetectionResult>>& detections,
+    float minConfidence)
+{
+    detections.resize(images.size());
+    const int nImages = images.size();
+    for (int start = 0; start < nImages; start += m_config.maxBatchSize)
+    {
+        const int count = std::min(m_config.maxBatchSize, nImages - start);
+        detectBatch(images.data() + start, count, m_config.inputSize, detections.data() + start, minConfidence);
+    }
+}
+
+void FaceDetector::detectRegions(const cv::Mat& image, const std::vector<cv::Rect>& rois,
+    std::vector<std::vector<DetectionResult>>& detections, float minConfidence)
+{
+    const int side = (m_config.dynamicInput) ? m_config.roiInputSize : m_config.inputSize;
+    detectCrops(image, rois, side, m_config.maxBatchSize, detections, minConfidence);
+}
+
+void FaceDetector::detect(
+    const cv::Mat& image, cv::Rect roi, std::vector<DetectionResult>& detections, float minConfidence)
+{
+    if (image.empty())
+        throw std::runtime_error("detect: Given empty image");
+    roi &= cv::Rect(cv::Point(), image.size());
+    if (roi.empty() || roi.size() == image.size())
+    {
+        detect(image, detections, minConfidence);
+        return;
+    }
+
+    /* Same pixels-per-input-pixel as a full-frame pass: cost shrinks with the region area. Fixed-shape models
+       take only inputSize, the region is letterboxed into it */
+    const int side = (m_config.dynamicInput) ? alignUp(std::max(Stride,
+        cvRound(static_cast<double>(m_config.inputSize) * std::max(roi.width, roi.height) / std::max(image.cols, image.rows))), Stride)
+        : m_config.inputSize;
+    m_tiles.assign(1, roi);
+    detectCrops(image, m_tiles, side, 1, m_tileDetections, minConfidence);
+    detections.swap(m_tileDetections[0]);
+}
+
+void FaceDetector::detectTiled(const cv::Mat& image, std::vector<DetectionResult>& detections, float minConfidence)
+{
+    detectTiled(image, cv::Rect(), detections, minConfidence);
+}
+
+void FaceDetector::detectTiled(
+    const cv::Mat& image, cv::Rect roi, std::vector<DetectionResult>& detections, float minConfidence)
 {
     if (image.empty())
         throw std::runtime_error("detect: Given empty image");
-    if (m_model.empty())
+    roi &= cv::Rect(cv::Point(), image.size());
+    if (roi.empty())
+        roi = cv::Rect(cv::Point(), image.size());
+
+    /* Evenly spread tiles overlapping by at least tileOverlap, plus the whole roi for faces larger than a tile */
+    if (roi.size() != m_tiledRegionSize) // tile grid depends on the roi size only
+    {
+        const auto tileOffsets = [this](int imageSide, std::vector<int>& offsets)
+        {
+            offsets.clear();
+            const int tileSide = std::min(m_config.tileSize, imageSide);
+            const float step = tileSide * (1.0f - std::clamp(m_config.tileOverlap, 0.0f, 0.9f));
+            const int nTiles = 1 + static_cast<int>(std::ceil((imageSide - tileSide) / step));
+            for (int i = 0; i < nTiles; ++i)
+                offsets.push_back((nTiles > 1) ? (imageSide - tileSide) * i / (nTiles - 1) : 0);
+            return tileSide;
+        };
+        m_tileSize.width = tileOffsets(roi.width, m_tileXs);
+        m_tileSize.height = tileOffsets(roi.height, m_tileYs);
+        m_tiledRegionSize = roi.size();
+    }
+    m_tiles.clear(); // shared with roi detect(), refilled from the cached grid
+    for (const int y : m_tileYs)
+        for (const int x : m_tileXs)
+            m_tiles.emplace_back(roi.tl() + cv::Point(x, y), m_tileSize);
+    if (m_config.tileGlobalPass && m_tiles.size() > 1)
+        m_tiles.push_back(roi);
+
+    const int batchSize = (m_config.tileBatchSize > 0) ? m_config.tileBatchSize : static_cast<int>(m_tiles.size());
+    detectCrops(image, m_tiles, m_config.inputSize, batchSize, m_tileDetections, minConfidence);
+
+    /* Cross-tile NMS: faces in overlaps are found by several tiles */
+    m_boxes.clear();
+    m_confidences.clear();
+    m_landmarks.clear();
+    for (const auto& tileDetections : m_tileDetections)
+    {
+        for (const auto& detection : tileDetections)
+        {
+            m_boxes.push_back(detection.boundingBox);
+            m_confidences.push_back(detection.confidence);
+            m_landmarks.push_back(detection.landmarks);
+        }
+    }
+    suppressOverlaps();
+
+    detections.clear();
+    for (auto index : m_keptIndices)
+        detections.emplace_back(m_boxes[index], m_landmarks[index], m_confidences[index]);
+}
+
+void FaceDetector::checkInput(int batchSize, int side)
+{
+    if (!m_backend)
+        throw std::runtime_error("checkInput: Model is not initialized");
+
+    side = alignUp(std::max(side, Stride), Stride);
+    const std::string shape = std::to_string(batchSize) + " x 3 x " + std::to_string(side) + " x " + std::to_string(side);
+    const int blobShape[] = { batchSize, 3, side, side };
+    m_blob.create(4, blobShape, CV_32F);
+    m_blob.setTo(cv::Scalar::all(0));
+    try
+    {
+        m_backend->infer(m_blob, m_outputs);
+    }
+    catch(const std::exception& e)
+    {
+        throw std::runtime_error("checkInput: Detection model does not accept " + shape
+            + " input, export it with dynamic axes:\n" + e.what());
+    }
+    if (m_outputs.empty() || m_outputs[0].dims < 2 || m_outputs[0].size[0] != batchSize)
+        throw std::runtime_error("checkInput: Detection model output does not follow " + shape
+            + " input, export it with dynamic axes");
+}
+
+void FaceDetector::detectCrops(const cv::Mat& image, const std::vector<cv::Rect>& rois, int side, int batchSize,
+    std::vector<std::vector<DetectionResult>>& detections, float minConfidence)
+{
+    if (image.empty())
+        throw std::runtime_error("detect: Given empty image");
+
+    /* Crops are views into the frame, no pixels are copied before letterboxing */
+    const cv::Rect imageRect(cv::Point(), image.size());
+    m_regionImages.clear();
+    for (const auto& roi : rois)
+    {
+        const auto clipped = roi & imageRect;
+        if (clipped.empty())
+            throw std::runtime_error("detect: Region is outside of the image");
+        m_regionImages.push_back(image(clipped));
+    }
+
+    detections.resize(rois.size());
+    const int nRegions = rois.size();
+    for (int start = 0; start < nRegions; start += batchSize)
+    {
+        const int count = std::min(batchSize, nRegions - start);
+        detectBatch(m_regionImages.data() + start, count, side, detections.data() + start, minConfidence);
+    }
+
+    /* Region -> frame coordinates */
+    for (int i = 0; i < nRegions; ++i)
+    {
+        const auto offset = (rois[i] & imageRect).tl();
+        for (auto& detection : detections[i])
+        {
+            detection.boundingBox += offset;
+            for (int k = 0; k < 5; ++k)
+            {
+                detection.landmarks[2 * k] += offset.x;
+                detection.landmarks[2 * k + 1] += offset.y;
+            }
+        }
+    }
+}
+
+void FaceDetector::detectBatch(
+    const cv::Mat* images, int count, int side, std::vector<DetectionResult>* detections, float minConfidence)
+{
+    if (!m_backend)
         throw std::runtime_error("detect: Model is not initialized");
 
-    /* Pre-process image */
-    cv::dnn::blobFromImage(
-        image, m_blob, InputScale, InputSize, cv::Scalar(0, 0, 0), true, false);
-    m_model.setInput(m_blob);
-    std::vector<cv::Mat> outs;
+    /* Common input size of the pass: every frame fits into it after letterboxing */
+    cv::Size inputSize;
+    for (int i = 0; i < count; ++i)
+    {
+        if (images[i].empty())
+            throw std::runtime_error("detect: Given empty image");
+        const auto imageInputSize = inputSizeFor(images[i].size(), side);
+        inputSize.width = std::max(inputSize.width, imageInputSize.width);
+        inputSize.height = std::max(inputSize.height, imageInputSize.height);
+    }
+
+    /* Pre-process images */
+    if (m_inputImages.size() < static_cast<std::size_t>(count))
+    {
+        m_inputImages.resize(count);
+        m_transforms.resize(count);
+    }
+    for (int i = 0; i < count; ++i)
+        m_transforms[i] = prepareInput(images[i], side, inputSize, m_inputImages[i]);
+    if (1 == count)
+        cv::dnn::blobFromImage(m_inputImages[0], m_blob, InputScale, cv::Size(), cv::Scalar(0, 0, 0), true, false);
+    else
+    {
+        m_batchImages.assign(m_inputImages.begin(), m_inputImages.begin() + count); // headers only, capacity kept
+        cv::dnn::blobFromImages(m_batchImages, m_blob, InputScale, cv::Size(), cv::Scalar(0, 0, 0), true, false);
+    }
 
     /* Infer */
-    m_model.forward(outs, m_unconnectedLayersNames);
+    m_backend->infer(m_blob, m_outputs);
 
-    /* Post-process result */
+    /* Post-process results, output cells of frame i follow those of frame i - 1 */
+    const auto& output = m_outputs[0];
+    const std::size_t cellsPerImage = output.total() / cellDimention / count;
+    for (int i = 0; i < count; ++i)
+        postprocess(output.ptr<float>() + i * cellsPerImage * cellDimention, cellsPerImage,
+            m_transforms[i], images[i].size(), minConfidence, detections[i]);
+}
 
-    const float scalex = static_cast<float>(image.cols) / InputSize.width;
-	const float scaley = static_cast<float>(image.rows) / InputSize.height;
-    const float* data = reinterpret_cast<float*>(outs[0].data);
-    const auto nCells = outs[0].size().width;
+cv::Size FaceDetector::inputSizeFor(cv::Size imageSize, int side) const
+{
+    if (!m_config.letterbox || !m_config.dynamicInput)
+        return cv::Size(side, side);
 
-    std::vector<cv::Rect> resultBoxes;
-	std::vector<float> resultConfidences;
-	std::vector<Landmarks> resultLandmarks;
-    for (int cell = 0; cell < nCells; ++cell)
+    const float scale = static_cast<float>(side) / std::max(imageSize.width, imageSize.height);
+    return cv::Size(
+        alignUp(std::max(1, cvRound(imageSize.width * scale)), Stride),
+        alignUp(std::max(1, cvRound(imageSize.height * scale)), Stride));
+}
+
+FaceDetector::InputTransform FaceDetector::prepareInput(const cv::Mat& image, int side, cv::Size inputSize, cv::Mat& input)
+{
+    InputTransform transform;
+    if (!m_config.letterbox)
     {
-        const auto objConfidence = data[cellDimention * cell + 4];
-        if (objConfidence < minConfidence)
-            continue;
-        const auto classConfidence = data[cellDimention * cell + 15];
-        const auto totalConfidence = objConfidence * classConfidence;
+        cv::resize(image, input, inputSize);
+        transform.scaleX = static_cast<float>(inputSize.width) / image.cols;
+        transform.scaleY = static_cast<float>(inputSize.height) / image.rows;
+        return transform;
+    }
+
+    /* Letterbox: scale long side to side, center the frame and pad the rest */
+    const float scale = static_cast<float>(side) / std::max(image.cols, image.rows);
+    const cv::Size resizedSize(
+        std::max(1, cvRound(image.cols * scale)), std::max(1, cvRound(image.rows * scale)));
+    const int padLeft = (inputSize.width - resizedSize.width) / 2;
+    const int padTop = (inputSize.height - resizedSize.height) / 2;
+
+    cv::resize(image, m_resizedImage, resizedSize);
+    cv::copyMakeBorder(m_resizedImage, input,
+        padTop, inputSize.height - resizedSize.height - padTop,
+        padLeft, inputSize.width - resizedSize.width - padLeft,
+        cv::BORDER_CONSTANT, PadColor);
+
+    transform.scaleX = scale;
+    transform.scaleY = scale;
+    transform.padX = static_cast<float>(padLeft);
+    transform.padY = static_cast<float>(padTop);
+    return transform;
+}
+
+void FaceDetector::postprocess(const float* data, std::size_t nCells, const InputTransform& transform, cv::Size imageSize,
+    float minConfidence, std::vector<DetectionResult>& detections)
+{
+    const float invScaleX = 1.0f / transform.scaleX;
+    const float invScaleY = 1.0f / transform.scaleY;
+
+    // vectorized objectness scan, only surviving cells are decoded
+    if (m_candidateCells.size() < nCells)
+        m_candidateCells.resize(nCells);
+    const auto nCandidates = simdSelectStrided(data + 4, nCells, cellDimention, minConfidence, m_candidateCells.data());
+
+    m_boxes.clear();
+    m_confidences.clear();
+    m_landmarks.clear();
+    for (std::size_t candidate = 0; candidate < nCandidates; ++candidate)
+    {
+        const float* cell = data + cellDimention * m_candidateCells[candidate];
+        const auto totalConfidence = cell[4] * cell[15];
         if (totalConfidence < minConfidence)
             continue;
 
-        const auto w = static_cast<int>(data[cellDimention * cell + 2] * scalex);
-        const auto h = static_cast<int>(data[cellDimention * cell + 3] * scaley);
-        const auto x = static_cast<int>(data[cellDimention * cell + 0] * scalex - 0.5 * w);
-        const auto y = static_cast<int>(data[cellDimention * cell + 1] * scaley - 0.5 * h);
-        const cv::Rect faceBoundingBox = cv::Rect(x, y, w, h) & cv::Rect(0, 0, image.cols, image.rows);
-
-		Landmarks cellLandmarks;
-        cellLandmarks.reserve(10);
-		for (int k = 5; k < 15; k+=2)
-		{
-			cellLandmarks.push_back(static_cast<int>(data[cellDimention * cell + k] * scalex));
-			cellLandmarks.push_back(static_cast<int>(data[cellDimention * cell + k + 1] * scaley));
-		}
+        const auto w = static_cast<int>(cell[2] * invScaleX);
+        const auto h = static_cast<int>(cell[3] * invScaleY);
+        const auto x = static_cast<int>((cell[0] - transform.padX) * invScaleX - 0.5 * w);
+        const auto y = static_cast<int>((cell[1] - transform.padY) * invScaleY - 0.5 * h);
+        m_boxes.emplace_back(cv::Rect(x, y, w, h) & cv::Rect(cv::Point(), imageSize));
+        m_confidences.push_back(totalConfidence);
 
-        resultConfidences.push_back(totalConfidence);
-        resultBoxes.emplace_back(faceBoundingBox);
-		resultLandmarks.emplace_back(std::move(cellLandmarks));
+        auto& cellLandmarks = m_landmarks.emplace_back();
+        for (int k = 0; k < 5; ++k)
+        {
+            cellLandmarks[2 * k] = static_cast<int>((cell[5 + 2 * k] - transform.padX) * invScaleX);
+            cellLandmarks[2 * k + 1] = static_cast<int>((cell[6 + 2 * k] - transform.padY) * invScaleY);
+        }
     }
 
-	std::vector<int> indices;
-	cv::dnn::NMSBoxes(resultBoxes, resultConfidences, minConfidence, NmsThreshold, indices);
+    suppressOverlaps();
 
-    std::vector<DetectionResult> result;
-    result.reserve(indices.size());
-    for (auto index : indices)
-        result.emplace_back(
-            resultBoxes[index], resultLandmarks[index], resultConfidences[index]);
+    detections.clear();
+    for (auto index : m_keptIndices)
+        detections.emplace_back(m_boxes[index], m_landmarks[index], m_confidences[index]);
+}
 
-    return result;
+void FaceDetector::suppressOverlaps()
+{
+    const int nBoxes = static_cast<int>(m_boxes.size());
+    const int maxKept = (m_config.maxDetections > 0) ? m_config.maxDetections : nBoxes;
+    m_order.resize(nBoxes);
+    std::iota(m_order.begin(), m_order.end(), 0);
+    m_keptIndices.clear();
+
+    const auto byConfidence = [this](int a, int b) { return m_confidences[a] > m_confidences[b]; };
+    int nSorted = 0;
+    int chunk = std::max(64, maxKept);
+    for (int i = 0; i < nBoxes && static_cast<int>(m_keptIndices.size()) < maxKept; ++i)
+    {
+        if (i == nSorted) // next best candidates are all in the unsorted tail
+        {
+            const int end = std::min(nBoxes, nSorted + chunk);
+            std::partial_sort(m_order.begin() + nSorted, m_order.begin() + end, m_order.end(), byConfidence);
+            nSorted = end;
+            chunk *= 2;
+        }
+
+        const auto& box = m_boxes[m_order[i]];
+        const auto area = box.area();
+        bool suppressed = false;
+        for (const auto kept : m_keptIndices)
+        {
+            const auto& keptBox = m_boxes[kept];
+            const auto intersection = (box & keptBox).area();
+            if (intersection > NmsThreshold * (area + keptBox.area() - intersection))
+            {
+                suppressed = true;
+                break;
+            }
+        }
+        if (!suppressed)
+            m_keptIndices.push_back(m_order[i]);
+    }
 }
\ No newline at end of file
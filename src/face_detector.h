@@ -1,22 +1,27 @@
 #pragma once
 
+#include <array>
+#include <memory>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <filesystem>
 namespace fs = std::filesystem;
 
 #include <opencv2/core.hpp>
-#include <opencv2/dnn.hpp>
+
+#include "inference_backend.h"
+#include "math.h"
 
 class FaceDetector final
 {
 public:
 
-    using Landmarks = std::vector<int>;
+    using Landmarks = ::Landmarks;
     struct DetectionResult
     {
         cv::Rect boundingBox;
-        Landmarks landmarks;
+        Landmarks landmarks {};
         float confidence { 0.0f };
 
         DetectionResult();
@@ -24,13 +29,133 @@ public:
         ~DetectionResult();
     };
 
+    static constexpr int Stride { 32 }; // largest YOLOv5 head stride, network input sides must be its multiples
+
+    struct Config
+    {
+        bool enableGpu { false };
+        InferenceBackend::Type backend { InferenceBackend::Type::OpenCvDnn };
+        fs::path cacheDir;          // optimized model cache, see InferenceBackend::Options
+        int inputSize { 640 };      // network input long side, rounded up to a multiple of Stride
+        bool letterbox { true };    // keep frame aspect ratio and pad, otherwise stretch frame to inputSize x inputSize
+        bool dynamicInput { false };// letterbox pads short side only up to a Stride multiple; model must accept dynamic shapes
+        int maxBatchSize { 8 };     // frames per forward pass in batch detect(), more frames are split into several passes
+        int roiInputSize { 192 };   // network input long side for detectRegions() with dynamicInput, fixed-shape models use inputSize
+        int tileSize { 960 };       // detectTiled() tile side in frame pixels, each tile is letterboxed to inputSize
+        float tileOverlap { 0.2f }; // min overlap of neighbouring tiles, as a fraction of tileSize
+        bool tileGlobalPass { true };// detectTiled() also runs the whole frame, for faces larger than a tile
+        int tileBatchSize { 0 };    // tiles per forward pass in detectTiled(), 0 - all tiles of a frame in one pass
+        int maxDetections { 256 };  // faces kept per frame (or crop), best first; 0 - no cap
+    };
+
     explicit FaceDetector(const fs::path& modelpath, bool enableGpu = false);
+    FaceDetector(const fs::path& modelpath, const Config& config);
     ~FaceDetector();
 
     std::vector<DetectionResult> detect(const cv::Mat& image, float minConfidence = 0.45f);
 
+    /**
+     * @brief Same as above, but fills caller-owned vector: together with the detector's own scratch buffers
+     * a detection call allocates nothing once the buffers have grown to the scene size.
+     */
+    void detect(const cv::Mat& image, std::vector<DetectionResult>& detections, float minConfidence = 0.45f);
+
+    /**
+     * @brief Detects faces on several frames (a stream backlog or frames of several cameras) with one NCHW forward
+     * pass per Config::maxBatchSize frames. Frames of a pass are letterboxed into one common input size.
+     * Model must accept dynamic batch size. detections[i] holds faces of images[i].
+     */
+    void detect(const std::vector<cv::Mat>& images, std::vector<std::vector<DetectionResult>>& detections,
+        float minConfidence = 0.45f);
+
+    /**
+     * @brief Detects faces only inside roi (e.g. where something moved). With Config::dynamicInput the roi is detected
+     * at the scale of a full-frame pass, so the cost shrinks with the roi area; otherwise it is letterboxed into inputSize.
+     */
+    void detect(const cv::Mat& image, cv::Rect roi, std::vector<DetectionResult>& detections, float minConfidence = 0.45f);
+
+    /**
+     * @brief Detects faces only inside regions of the frame (e.g. expanded tracker predictions), batched like frames,
+     * with Config::roiInputSize network input (Config::inputSize if the model input is not dynamic).
+     * Much cheaper than a full-frame pass for a few small regions.
+     * Boxes and landmarks are in frame coordinates, detections[i] holds faces of rois[i].
+     */
+    void detectRegions(const cv::Mat& image, const std::vector<cv::Rect>& rois,
+        std::vector<std::vector<DetectionResult>>& detections, float minConfidence = 0.45f);
+
+    /**
+     * @brief Detects small faces on high-resolution frames: overlapping Config::tileSize tiles are detected
+     * at close to native resolution as batches, results are merged with cross-tile NMS.
+     */
+    void detectTiled(const cv::Mat& image, std::vector<DetectionResult>& detections, float minConfidence = 0.45f);
+
+    /**
+     * @brief Same as above, but tiles only roi (e.g. where something moved). Empty roi means the whole frame.
+     */
+    void detectTiled(const cv::Mat& image, cv::Rect roi, std::vector<DetectionResult>& detections,
+        float minConfidence = 0.45f);
+
+    /**
+     * @brief Runs a blank batchSize x 3 x side x side pass. Throws std::runtime_error if the model rejects it,
+     * so that a model exported with fixed batch or input shape fails at start-up rather than mid-stream.
+     */
+    void checkInput(int batchSize, int side);
+
 private:
-    cv::dnn::Net m_model;
+    /* Maps network input coordinates back to the frame: frame = (input - pad) / scale */
+    struct InputTransform
+    {
+        float scaleX { 1.0f };
+        float scaleY { 1.0f };
+        float padX { 0.0f };
+        float padY { 0.0f };
+    };
+
+    /**
+     * @brief Network input size for the frame with given long side: square, or letterboxed frame padded to Stride multiples.
+     */
+    cv::Size inputSizeFor(cv::Size imageSize, int side) const;
+
+    /**
+     * @brief Resizes (and letterboxes) frame to network input size as CV_8UC3 image.
+     */
+    InputTransform prepareInput(const cv::Mat& image, int side, cv::Size inputSize, cv::Mat& input);
+
+    void detectBatch(const cv::Mat* images, int count, int side, std::vector<DetectionResult>* detections, float minConfidence);
+
+    void detectCrops(const cv::Mat& image, const std::vector<cv::Rect>& rois, int side, int batchSize,
+        std::vector<std::vector<DetectionResult>>& detections, float minConfidence);
+
+    void postprocess(const float* data, std::size_t nCells, const InputTransform& transform, cv::Size imageSize,
+        float minConfidence, std::vector<DetectionResult>& detections);
+
+    /**
+     * @brief Greedy NMS over m_boxes / m_confidences into m_keptIndices, best first, up to Config::maxDetections.
+     * Candidates are sorted lazily in growing chunks, so a capped or sparse result does not pay for a full sort.
+     */
+    void suppressOverlaps();
+
+    Config m_config;
+    std::unique_ptr<InferenceBackend> m_backend;
+    cv::Mat m_resizedImage;
+    std::vector<cv::Mat> m_regionImages;
+    std::vector<cv::Rect> m_tiles;
+    cv::Size m_tiledRegionSize; // frame (or roi) size the tile grid below was computed for
+    cv::Size m_tileSize;
+    std::vector<int> m_tileXs;
+    std::vector<int> m_tileYs;
+    std::vector<std::vector<DetectionResult>> m_tileDetections;
+    std::vector<cv::Mat> m_inputImages;
+    std::vector<cv::Mat> m_batchImages;
+    std::vector<InputTransform> m_transforms;
     cv::Mat m_blob;
-    std::vector<std::string> m_unconnectedLayersNames;
+    std::vector<cv::Mat> m_outputs;
+
+    /* Post-processing scratch buffers, reused between calls */
+    std::vector<std::int32_t> m_candidateCells;
+    std::vector<cv::Rect> m_boxes;
+    std::vector<float> m_confidences;
+    std::vector<Landmarks> m_landmarks;
+    std::vector<int> m_order;
+    std::vector<int> m_keptIndices;
 };
\ No newline at end of file
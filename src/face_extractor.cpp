@@ -1,107 +1,236 @@
+#include <cstring>
+#include <iostream>
+#include <algorithm>
 #include <stdexcept>
 
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 
 #include "face_extractor.h"
 
 namespace
 {
 
-constexpr double ScaleAlpha { 1.0 / 127.5 };
-constexpr double ScaleBeta { -0.5 / 0.5 };
+constexpr float ScaleAlpha { 1.0f / 127.5f };
+constexpr float ScaleBeta { -0.5f / 0.5f };
 
-/* Convert cv::Mat to torch::Tensor */
-void matToTensor(const cv::Mat& in, torch::Tensor& out)
+#if CV_SIMD128
+/* Widens 16 uint8 values to float, applies alpha * x + beta and stores them contiguously */
+inline void storeNormalized(const cv::v_uint8x16& v, cv::v_float32x4 alpha, cv::v_float32x4 beta, float* dst)
 {
-    const bool isChar = (in.type() & 0xF) < 2;
-    const std::vector<int64_t> dims = {in.rows, in.cols, in.channels()};
-    out = torch::from_blob(in.data, dims, isChar ? torch::kByte : torch::kFloat);
+    cv::v_uint16x8 lo16, hi16;
+    cv::v_expand(v, lo16, hi16);
+    cv::v_uint32x4 a, b, c, d;
+    cv::v_expand(lo16, a, b);
+    cv::v_expand(hi16, c, d);
+    cv::v_store(dst, cv::v_fma(cv::v_cvt_f32(cv::v_reinterpret_as_s32(a)), alpha, beta));
+    cv::v_store(dst + 4, cv::v_fma(cv::v_cvt_f32(cv::v_reinterpret_as_s32(b)), alpha, beta));
+    cv::v_store(dst + 8, cv::v_fma(cv::v_cvt_f32(cv::v_reinterpret_as_s32(c)), alpha, beta));
+    cv::v_store(dst + 12, cv::v_fma(cv::v_cvt_f32(cv::v_reinterpret_as_s32(d)), alpha, beta));
 }
+#endif
 
-}
-
-FaceExtractor::FaceExtractor(const fs::path& modelpath, bool enableGpu)
-    : m_device(torch::DeviceType::CPU)
+/* CV_8UC3 HWC image -> normalized float CHW planes in one pass: deinterleave, widen, scale and shift */
+void bgrToNormalizedChw(const cv::Mat& image, float alpha, float beta, float* out)
 {
-    /* Check CUDA availability */
-    m_device = (enableGpu) ? torch::DeviceType::CUDA : torch::DeviceType::CPU;
-    if (torch::kCUDA == m_device)
+    const int planeSize = image.rows * image.cols;
+    float* planes[3] = { out, out + planeSize, out + 2 * planeSize };
+    for (int y = 0; y < image.rows; ++y)
     {
-        if (torch::cuda::is_available())
-        {
-            m_device = torch::DeviceType::CUDA;
-        }
-        else
+        const auto* src = image.ptr<std::uint8_t>(y);
+        const int rowOffset = y * image.cols;
+        int x = 0;
+#if CV_SIMD128
+        const auto vAlpha = cv::v_setall_f32(alpha);
+        const auto vBeta = cv::v_setall_f32(beta);
+        for (; x + 16 <= image.cols; x += 16)
         {
-            m_device = torch::DeviceType::CPU;
-            std::cout << "FaceExtractor: LibTorch CUDA is not available! Switching calculations to CPU ..." << std::endl;
+            cv::v_uint8x16 c0, c1, c2;
+            cv::v_load_deinterleave(src + 3 * x, c0, c1, c2);
+            storeNormalized(c0, vAlpha, vBeta, planes[0] + rowOffset + x);
+            storeNormalized(c1, vAlpha, vBeta, planes[1] + rowOffset + x);
+            storeNormalized(c2, vAlpha, vBeta, planes[2] + rowOffset + x);
         }
+#endif
+        for (; x < image.cols; ++x)
+            for (int c = 0; c < 3; ++c)
+                planes[c][rowOffset + x] = src[3 * x + c] * alpha + beta;
     }
+}
 
+int paddedBatchSize(int count, int maxBatchSize)
+{
+    int result = 1;
+    while (result < count)
+        result *= 2;
+    return std::min(result, maxBatchSize);
+}
+
+}
+
+FaceExtractor::Precision FaceExtractor::parsePrecision(const std::string& precision)
+{
+    if ("f32" == precision)
+        return Precision::Float32;
+    if ("bf16" == precision)
+        return Precision::BFloat16;
+    if ("int8" == precision)
+        return Precision::Int8;
+    throw std::runtime_error("FaceExtractor::parsePrecision: Unknown precision " + precision);
+}
+
+bool FaceExtractor::hasNativeBFloat16() noexcept
+{
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx512bf16");
+#else
+    return false;
+#endif
+}
+
+FaceExtractor::FaceExtractor(const fs::path& modelpath, bool enableGpu)
+    : FaceExtractor(modelpath, Config { enableGpu })
+{}
+
+FaceExtractor::FaceExtractor(const fs::path& modelpath, const Config& config)
+    : m_config(config)
+{
+    if (m_config.maxBatchSize < 1)
+        throw std::runtime_error("FaceExtractor: maxBatchSize must be positive");
+    const int blobSizes[4] = { m_config.maxBatchSize, 3, InputSize.height, InputSize.width };
+    m_inputBlob.create(4, blobSizes, CV_32F);
+
+    const bool isTorch = (InferenceBackend::Type::LibTorch == m_config.backend);
+    if (Precision::Float32 != m_config.precision && !isTorch)
+        std::cout << "FaceExtractor: Reduced precision is LibTorch only, "
+            << InferenceBackend::typeName(m_config.backend) << " runs the model as stored" << std::endl;
+    if (Precision::BFloat16 == m_config.precision && isTorch && !m_config.enableGpu && !hasNativeBFloat16())
+        std::cout << "FaceExtractor: CPU has no native bfloat16 support, bf16 mode will be emulated and slow" << std::endl;
+
+    InferenceBackend::Options options;
+    options.enableGpu = m_config.enableGpu;
+    options.optimize = m_config.optimize;
+    options.bfloat16 = isTorch && (Precision::BFloat16 == m_config.precision);
+    options.quantized = isTorch && (Precision::Int8 == m_config.precision);
+    options.intraOpThreads = m_config.intraOpThreads;
+    options.interOpThreads = m_config.interOpThreads;
+    options.cacheDir = m_config.cacheDir;
     try
     {
-        // De-serialize ScriptModule from file
-        m_model = torch::jit::load(modelpath.string(), m_device);
+        m_backend = InferenceBackend::create(m_config.backend, modelpath, options);
     }
-    catch(const torch::Error& e)
+    catch(const std::exception& e)
     {
         std::cerr << "FaceExtractor: Could not read model:\n" << e.what() << std::endl;
+        return;
+    }
+    warmUp();
+}
+FaceExtractor::~FaceExtractor() = default;
+
+void FaceExtractor::warmUp()
+{
+    if (m_config.warmupRuns <= 0)
+        return;
+
+    /* Every batch shape extract() can produce is compiled and profiled here */
+    std::vector<int> batchSizes;
+    for (int count = 1; count < m_config.maxBatchSize; count = (m_config.padBatches) ? count * 2 : count + 1)
+        batchSizes.push_back(count);
+    batchSizes.push_back(m_config.maxBatchSize);
+
+    const cv::Mat blackFace(InputSize, CV_8UC3, cv::Scalar::all(0));
+    const std::vector<cv::Mat> faces(m_config.maxBatchSize, blackFace);
+    try
+    {
+        for (const int count : batchSizes)
+            for (int run = 0; run < m_config.warmupRuns; ++run)
+                forwardBatch(faces.data(), count);
     }
-    catch(...)
+    catch(const std::exception& e)
     {
-        std::cerr << "FaceExtractor: Could not read model: unknown error." << std::endl;
+        std::cerr << "FaceExtractor: Warm-up failed:\n" << e.what() << std::endl;
     }
 }
-FaceExtractor::~FaceExtractor() = default;
 
 FaceExtractor::Embedding FaceExtractor::extract(const cv::Mat& faceImage)
 {
-    if (faceImage.empty())
-        throw std::runtime_error("extract: Given empty image");
+    return std::move(extract(std::vector<cv::Mat> { faceImage })[0]);
+}
 
-    /* Pre-process */
+std::vector<FaceExtractor::Embedding> FaceExtractor::extract(const std::vector<cv::Mat>& faceImages)
+{
+    cv::Mat embeddings;
+    extract(faceImages, embeddings);
 
-    // 1. Resize
-    cv::Mat resizedImage; // ACHTUNG! can be ref or deep copy.
-    if (faceImage.size() == InputSize)
-        resizedImage = faceImage;
-    else
-        cv::resize(faceImage, resizedImage, InputSize, 0.0, 0.0, cv::INTER_CUBIC);
+    std::vector<Embedding> result;
+    result.reserve(embeddings.rows);
+    for (int i = 0; i < embeddings.rows; ++i)
+        result.emplace_back(embeddings.ptr<float>(i), embeddings.ptr<float>(i) + embeddings.cols);
+    return result;
+}
 
-    // 2. Normalize
-    cv::Mat normalizedImage; // float32
-    resizedImage.convertTo(normalizedImage, CV_32FC3, ScaleAlpha, ScaleBeta);
+void FaceExtractor::extract(const std::vector<cv::Mat>& faceImages, cv::Mat& embeddings)
+{
+    const int nFaces = faceImages.size();
+    if (0 == nFaces)
+    {
+        embeddings.release();
+        return;
+    }
 
-    // 3. Convert to torch::Tensor
-    matToTensor(normalizedImage, m_inputTensor);
+    for (int start = 0; start < nFaces; start += m_config.maxBatchSize)
+    {
+        const int count = std::min(m_config.maxBatchSize, nFaces - start);
+        const auto output = forwardBatch(faceImages.data() + start, count);
+        const int embeddingDim = output.cols;
+        if (0 == start)
+            embeddings.create(nFaces, embeddingDim, CV_32F);
+
+        for (int i = 0; i < count; ++i)
+            std::memcpy(embeddings.ptr<float>(start + i), output.ptr<float>(i), embeddingDim * sizeof(float));
+    }
+}
 
-    // 4. Make blob
-    m_inputTensor = m_inputTensor.permute({2,0,1}); // HWC -> CHW
-    m_inputTensor = m_inputTensor.toType(torch::kFloat);
-    m_inputTensor.unsqueeze_(0); // CHW -> NCHW
-    std::vector<torch::jit::IValue> blob;
-    blob.emplace_back(m_inputTensor.to(m_device));
+void FaceExtractor::preprocess(const cv::Mat& faceImage, float* out)
+{
+    if (faceImage.empty())
+        throw std::runtime_error("extract: Given empty image");
+    if (CV_8UC3 != faceImage.type())
+        throw std::runtime_error("extract: Expected CV_8UC3 image");
 
-    /* Infer */
-    const auto y = m_model.forward(blob);
-    torch::Tensor embeddingTensor;
-    if (y.isTuple())
-        embeddingTensor = y.toTuple()->elements()[0].toTensor();
-    else if (y.isTensor())
-        embeddingTensor = y.toTensor().detach().clone();
-
-    /* Post-process result */
-    Embedding result(
-        embeddingTensor.data_ptr<float>(), embeddingTensor.data_ptr<float>() + embeddingTensor.numel());
-    return result;
+    /* Resize into the persistent buffer unless the face already has the input size */
+    const cv::Mat* resizedImage = &faceImage;
+    if (faceImage.size() != InputSize)
+    {
+        cv::resize(faceImage, m_resizedImage, InputSize, 0.0, 0.0, cv::INTER_CUBIC);
+        resizedImage = &m_resizedImage;
+    }
+    bgrToNormalizedChw(*resizedImage, ScaleAlpha, ScaleBeta, out);
 }
 
-std::vector<FaceExtractor::Embedding> FaceExtractor::extract(const std::vector<cv::Mat>& faceImages)
+cv::Mat FaceExtractor::forwardBatch(const cv::Mat* faceImages, int count)
 {
-    std::vector<Embedding> result;
-    result.reserve(faceImages.size());
-    for (const auto& faceImage : faceImages)
-        result.emplace_back(std::move(extract(faceImage)));
-    return result;
-}
\ No newline at end of file
+    if (!m_backend)
+        throw std::runtime_error("extract: Model is not initialized");
+
+    /* Pre-process straight into the preallocated NCHW blob, padding rows are zeros */
+    const int batchSize = (m_config.padBatches) ? paddedBatchSize(count, m_config.maxBatchSize) : count;
+    const int inputSizes[4] = { batchSize, 3, InputSize.height, InputSize.width };
+    const cv::Mat input(4, inputSizes, CV_32F, m_inputBlob.data); // leading rows: still contiguous
+    const std::size_t imageSize = 3 * InputSize.area();
+    float* inputData = m_inputBlob.ptr<float>();
+    for (int i = 0; i < count; ++i)
+        preprocess(faceImages[i], inputData + i * imageSize);
+    if (count < batchSize)
+        std::fill(inputData + count * imageSize, inputData + batchSize * imageSize, 0.0f);
+
+    /* Infer */
+    m_backend->infer(input, m_outputs);
+    if (m_outputs.empty() || m_outputs[0].total() % batchSize != 0)
+        throw std::runtime_error("extract: Unexpected model output");
+
+    /* Output is only read before the next forward: no copy, just a batchSize x D view */
+    return m_outputs[0].reshape(1, batchSize);
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 #include <filesystem>
@@ -7,8 +8,7 @@ namespace fs = std::filesystem;
 
 #include <opencv2/core.hpp>
 
-#include <torch/script.h>
-#include <torch/cuda.h>
+#include "inference_backend.h"
 
 class FaceExtractor final
 {
@@ -27,14 +27,63 @@ public:
 
     using Embedding = std::vector<float>;
 
+    enum class Precision
+    {
+        Float32,
+        BFloat16,   // weights and activations in bfloat16; fast only on CPUs with AVX512-BF16 / AMX
+        Int8        // model file must be statically quantized TorchScript (calibrated on FaceCollector crops), CPU only
+                    // Reduced precisions are LibTorch only, other backends take precision from the model file
+    };
+
+    /**
+     * @brief Parses "f32", "bf16" or "int8". Throws std::runtime_error on unknown value.
+     */
+    static Precision parsePrecision(const std::string& precision);
+
+    /**
+     * @brief Whether the CPU computes bfloat16 natively rather than through float32 emulation.
+     */
+    static bool hasNativeBFloat16() noexcept;
+
+    struct Config
+    {
+        bool enableGpu { false };
+        InferenceBackend::Type backend { InferenceBackend::Type::LibTorch };
+        Precision precision { Precision::Float32 };
+        int maxBatchSize { 16 };    // faces per forward pass, more faces are split into several passes
+        bool padBatches { true };   // round batch up to a power of two, so only a few input shapes ever reach the model
+        bool optimize { true };     // backend graph optimizations, see InferenceBackend::Options
+        int intraOpThreads { 0 };   // backend threads per operator, 0 keeps backend default. Process-wide for LibTorch
+        int interOpThreads { 0 };   // backend inter-op pool size, 0 keeps backend default. Process-wide for LibTorch, settable once
+        int warmupRuns { 2 };       // dummy forward passes per batch shape, so JIT profiling is done before real frames
+        fs::path cacheDir;          // optimized model cache, see InferenceBackend::Options
+    };
+
     explicit FaceExtractor(const fs::path& modelpath, bool enableGpu = false);
+    FaceExtractor(const fs::path& modelpath, const Config& config);
     ~FaceExtractor();
 
     Embedding extract(const cv::Mat& faceImage);
+
+    /**
+     * @brief Extracts embeddings of all faces with one NCHW forward pass per Config::maxBatchSize faces.
+     */
     std::vector<Embedding> extract(const std::vector<cv::Mat>& faceImages);
 
+    /**
+     * @brief Writes embeddings of CV_8UC3 faces as rows of caller-owned N x D CV_32F matrix.
+     * The matrix is reallocated only when N or D change, so reusing it between frames avoids allocations.
+     */
+    void extract(const std::vector<cv::Mat>& faceImages, cv::Mat& embeddings);
+
 private:
-    torch::DeviceType m_device;
-    torch::jit::script::Module m_model;
-    torch::Tensor m_inputTensor;
+    void warmUp();
+    void preprocess(const cv::Mat& faceImage, float* out);
+    cv::Mat forwardBatch(const cv::Mat* faceImages, int count);
+
+    Config m_config;
+    std::unique_ptr<InferenceBackend> m_backend;
+    cv::Mat m_inputBlob;            // maxBatchSize x 3 x H x W, allocated once
+    std::vector<cv::Mat> m_outputs;
+    cv::Mat m_resizedImage;
 };
\ No newline at end of file
@@ -0,0 +1,860 @@
+#include <cmath>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include "simd.h"
+#include "gallery.h"
+
+namespace
+{
+
+constexpr int GemmBlockRows { 512 }; // 512 x 512 floats = 1 MiB of gallery per block
+constexpr std::size_t ShardBytes { 256 * 1024 }; // gallery rows scanned by one thread at a time stay in L2
+
+constexpr char BinaryMagic[8] = { 'F', 'R', 'G', 'A', 'L', 'L', 'R', 'Y' };
+constexpr std::uint32_t BinaryVersion { 3 };
+constexpr std::uint32_t ByteOrderMark { 0x01020304 };
+constexpr std::uint64_t SectionAlignment { 64 };
+
+struct BinaryHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byteOrderMark;
+    std::uint64_t count;
+    std::uint64_t dim;
+    std::uint64_t namesOffset;
+    std::uint64_t namesSize;
+    std::uint64_t embeddingsOffset;
+    std::uint64_t float16Offset;    // version 2, 0 if absent
+    std::uint64_t int8Offset;       // version 2, 0 if absent
+    std::uint64_t int8ScalesOffset; // version 2, 0 if absent
+    std::uint64_t exemplarCount;    // version 3, 0 if absent
+    std::uint64_t exemplarsOffset;
+    std::uint64_t exemplarRangesOffset;
+    std::uint64_t reserved[3];
+};
+static_assert(sizeof(BinaryHeader) == 128, "BinaryHeader must be 128 bytes");
+
+std::uint64_t alignUp(std::uint64_t value)
+{
+    return (value + SectionAlignment - 1) / SectionAlignment * SectionAlignment;
+}
+
+void writePadding(std::ofstream& out, std::uint64_t position)
+{
+    static const char zeros[SectionAlignment] = {};
+    out.write(zeros, alignUp(position) - position);
+}
+
+bool hasBinaryMagic(const fs::path& filepath)
+{
+    std::ifstream in(filepath, std::ios::binary);
+    char magic[sizeof(BinaryMagic)];
+    return in.read(magic, sizeof(magic)) && 0 == std::memcmp(magic, BinaryMagic, sizeof(BinaryMagic));
+}
+
+/* Min-heap on similarity, so the worst of k kept candidates is on top */
+bool worseMatch(const Gallery::Match& a, const Gallery::Match& b)
+{
+    return a.second > b.second;
+}
+
+void pushTopK(std::vector<Gallery::Match>& heap, std::size_t k, Gallery::Match candidate)
+{
+    if (heap.size() < k)
+    {
+        heap.push_back(candidate);
+        std::push_heap(heap.begin(), heap.end(), worseMatch);
+    }
+    else if (candidate.second > heap.front().second)
+    {
+        std::pop_heap(heap.begin(), heap.end(), worseMatch);
+        heap.back() = candidate;
+        std::push_heap(heap.begin(), heap.end(), worseMatch);
+    }
+}
+
+}
+
+Gallery Gallery::load(const fs::path& filepath)
+{
+    return hasBinaryMagic(filepath) ? loadBinary(filepath) : loadFileStorage(filepath);
+}
+
+Gallery::Precision Gallery::parsePrecision(const std::string& precision)
+{
+    if ("f32" == precision)
+        return Precision::Float32;
+    if ("f16" == precision)
+        return Precision::Float16;
+    if ("int8" == precision)
+        return Precision::Int8;
+    throw std::runtime_error("Gallery::parsePrecision: Unknown precision " + precision);
+}
+
+bool Gallery::isFileStoragePath(const fs::path& filepath)
+{
+    auto ext = filepath.extension();
+    if (".gz" == ext)
+        ext = filepath.stem().extension();
+    return ".xml" == ext || ".yml" == ext || ".yaml" == ext || ".json" == ext;
+}
+
+Gallery Gallery::loadFileStorage(const fs::path& filepath)
+{
+    cv::FileStorage fileStorage;
+    try
+    {
+        fileStorage.open(filepath.string(), cv::FileStorage::READ);
+    }
+    catch(const cv::Exception& e)
+    {
+        throw std::runtime_error(std::string("Gallery::load: ") + e.what());
+    }
+    if (!fileStorage.isOpened())
+        throw std::runtime_error("Gallery::load: Could not open " + filepath.string());
+
+    const auto namesNode = fileStorage["Names"];
+    if (cv::FileNode::SEQ != namesNode.type())
+        throw std::runtime_error("Gallery::load: Failed to read names. Data invalid.");
+
+    std::vector<std::string> names;
+    for (auto it = namesNode.begin(); it != namesNode.end(); ++it)
+        names.emplace_back(static_cast<std::string>(*it));
+
+    Matr embeddings;
+    embeddings.reserve(names.size());
+    for (const auto& name : names)
+    {
+        cv::Mat embeddingMat;
+        fileStorage[name] >> embeddingMat;
+        if (embeddingMat.empty() || CV_32F != embeddingMat.depth())
+            throw std::runtime_error("Gallery::load: Invalid embedding for " + name);
+        embeddings.emplace_back(embeddingMat.begin<float>(), embeddingMat.end<float>());
+    }
+
+    /* Optional exemplars: sequence of k x dim matrices in "Names" order */
+    std::vector<Matr> exemplars;
+    const auto exemplarsNode = fileStorage["Exemplars"];
+    if (cv::FileNode::SEQ == exemplarsNode.type())
+    {
+        if (exemplarsNode.size() != names.size())
+            throw std::runtime_error("Gallery::load: Names and exemplars count mismatch");
+
+        exemplars.resize(names.size());
+        int i = 0;
+        for (auto it = exemplarsNode.begin(); it != exemplarsNode.end(); ++it, ++i)
+        {
+            cv::Mat exemplarsMat;
+            *it >> exemplarsMat;
+            if (!exemplarsMat.empty() && CV_32F != exemplarsMat.depth())
+                throw std::runtime_error("Gallery::load: Invalid exemplars for " + names[i]);
+            for (int r = 0; r < exemplarsMat.rows; ++r)
+                exemplars[i].emplace_back(exemplarsMat.ptr<float>(r), exemplarsMat.ptr<float>(r) + exemplarsMat.cols);
+        }
+    }
+
+    return Gallery(std::move(names), embeddings, exemplars);
+}
+
+Gallery Gallery::loadBinary(const fs::path& filepath)
+{
+    auto mappedFile = std::make_shared<MappedFile>(filepath);
+    const auto* base = mappedFile->data();
+    const std::uint64_t fileSize = mappedFile->size();
+    if (fileSize < sizeof(BinaryHeader))
+        throw std::runtime_error("Gallery::load: Truncated header");
+
+    BinaryHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    if (ByteOrderMark != header.byteOrderMark)
+        throw std::runtime_error("Gallery::load: Unsupported byte order");
+    if (header.version < 1 || header.version > BinaryVersion)
+        throw std::runtime_error("Gallery::load: Unsupported version " + std::to_string(header.version));
+
+    // matrices below are int-sized (count + 1 rows for exemplar ranges); also keeps the size products from overflowing
+    constexpr std::uint64_t MaxRows = std::numeric_limits<int>::max() - 1;
+    if (header.count > MaxRows || header.dim > MaxRows || header.exemplarCount > MaxRows)
+        throw std::runtime_error("Gallery::load: Data invalid");
+
+    const std::uint64_t offsetsSize = (header.count + 1) * sizeof(std::uint64_t);
+    const std::uint64_t embeddingsSize = header.count * header.dim * sizeof(float);
+    if (0 == header.count)
+        return Gallery();
+    if (0 == header.dim
+        || 0 != header.namesOffset % SectionAlignment
+        || header.namesSize < offsetsSize
+        || header.namesOffset + header.namesSize > fileSize
+        || 0 != header.embeddingsOffset % SectionAlignment
+        || header.embeddingsOffset + embeddingsSize > fileSize)
+        throw std::runtime_error("Gallery::load: Data invalid");
+
+    Gallery gallery;
+    gallery.m_nameOffsets = reinterpret_cast<const std::uint64_t*>(base + header.namesOffset);
+    gallery.m_nameChars = reinterpret_cast<const char*>(base + header.namesOffset + offsetsSize);
+    const std::uint64_t nameCharsSize = header.namesSize - offsetsSize;
+    for (std::uint64_t i = 0; i < header.count; ++i) // name() slices the blob with these unchecked
+    {
+        if (gallery.m_nameOffsets[i] > gallery.m_nameOffsets[i + 1])
+            throw std::runtime_error("Gallery::load: Data invalid");
+    }
+    if (0 != gallery.m_nameOffsets[0] || gallery.m_nameOffsets[header.count] > nameCharsSize)
+        throw std::runtime_error("Gallery::load: Data invalid");
+
+    // cv::Mat header over read-only mapping: never written to
+    gallery.m_embeddings = cv::Mat(
+        static_cast<int>(header.count), static_cast<int>(header.dim), CV_32F,
+        const_cast<unsigned char*>(base + header.embeddingsOffset));
+
+    const std::uint64_t float16Size = header.count * header.dim * sizeof(std::uint16_t);
+    if (0 != header.float16Offset)
+    {
+        if (0 != header.float16Offset % SectionAlignment || header.float16Offset + float16Size > fileSize)
+            throw std::runtime_error("Gallery::load: Data invalid");
+        gallery.m_embeddingsF16 = cv::Mat(
+            static_cast<int>(header.count), static_cast<int>(header.dim), CV_16F,
+            const_cast<unsigned char*>(base + header.float16Offset));
+    }
+
+    const std::uint64_t int8Size = header.count * header.dim;
+    const std::uint64_t int8ScalesSize = header.count * sizeof(float);
+    if (0 != header.int8Offset)
+    {
+        if (0 != header.int8Offset % SectionAlignment || header.int8Offset + int8Size > fileSize
+            || 0 != header.int8ScalesOffset % SectionAlignment || header.int8ScalesOffset + int8ScalesSize > fileSize)
+            throw std::runtime_error("Gallery::load: Data invalid");
+        gallery.m_embeddingsInt8 = cv::Mat(
+            static_cast<int>(header.count), static_cast<int>(header.dim), CV_8S,
+            const_cast<unsigned char*>(base + header.int8Offset));
+        gallery.m_int8Scales = cv::Mat(
+            static_cast<int>(header.count), 1, CV_32F,
+            const_cast<unsigned char*>(base + header.int8ScalesOffset));
+    }
+
+    const std::uint64_t exemplarsSize = header.exemplarCount * header.dim * sizeof(float);
+    const std::uint64_t exemplarRangesSize = (header.count + 1) * sizeof(std::int32_t);
+    if (0 != header.exemplarCount)
+    {
+        if (0 != header.exemplarsOffset % SectionAlignment || header.exemplarsOffset + exemplarsSize > fileSize
+            || 0 != header.exemplarRangesOffset % SectionAlignment
+            || header.exemplarRangesOffset + exemplarRangesSize > fileSize)
+            throw std::runtime_error("Gallery::load: Data invalid");
+        gallery.m_exemplars = cv::Mat(
+            static_cast<int>(header.exemplarCount), static_cast<int>(header.dim), CV_32F,
+            const_cast<unsigned char*>(base + header.exemplarsOffset));
+        gallery.m_exemplarRanges = cv::Mat(
+            static_cast<int>(header.count + 1), 1, CV_32S,
+            const_cast<unsigned char*>(base + header.exemplarRangesOffset));
+        // rerankExemplars() indexes exemplar rows straight from these ranges
+        const auto* ranges = gallery.m_exemplarRanges.ptr<std::int32_t>();
+        if (0 != ranges[0] || header.exemplarCount != static_cast<std::uint64_t>(ranges[header.count]))
+            throw std::runtime_error("Gallery::load: Data invalid");
+        for (std::uint64_t i = 0; i < header.count; ++i)
+        {
+            if (ranges[i] > ranges[i + 1])
+                throw std::runtime_error("Gallery::load: Data invalid");
+        }
+    }
+
+    gallery.m_mappedFile = std::move(mappedFile);
+    return gallery;
+}
+
+Gallery::Gallery() = default;
+
+Gallery::Gallery(std::vector<std::string> names, const Matr& embeddings, const std::vector<Matr>& exemplars)
+    : m_names(std::move(names))
+{
+    if (m_names.size() != embeddings.size())
+        throw std::runtime_error("Gallery: names and embeddings count mismatch");
+    if (embeddings.empty())
+        return;
+    if (embeddings.size() >= static_cast<std::size_t>(std::numeric_limits<int>::max())
+        || embeddings[0].size() >= static_cast<std::size_t>(std::numeric_limits<int>::max()))
+        throw std::runtime_error("Gallery: Too many embeddings or dimentions");
+
+    const int rows = embeddings.size();
+    const int cols = embeddings[0].size();
+    if (0 == cols)
+        throw std::runtime_error("Gallery: Empty embedding");
+
+    m_embeddings.create(rows, cols, CV_32F);
+    for (int i = 0; i < rows; ++i)
+    {
+        if (embeddings[i].size() != cols)
+            throw std::runtime_error("Gallery: embedding dimentions must be equal");
+
+        float* row = m_embeddings.ptr<float>(i);
+        std::copy(embeddings[i].begin(), embeddings[i].end(), row);
+        simdNormalize(row, cols);
+    }
+
+    if (exemplars.empty())
+        return;
+    if (exemplars.size() != rows)
+        throw std::runtime_error("Gallery: names and exemplars count mismatch");
+
+    std::size_t nExemplars = 0;
+    for (const auto& personExemplars : exemplars)
+        nExemplars += personExemplars.size();
+    if (nExemplars >= static_cast<std::size_t>(std::numeric_limits<int>::max()))
+        throw std::runtime_error("Gallery: Too many exemplars");
+    if (0 == nExemplars)
+        return;
+
+    m_exemplars.create(static_cast<int>(nExemplars), cols, CV_32F);
+    m_exemplarRanges.create(rows + 1, 1, CV_32S);
+    int exemplarRow = 0;
+    for (int i = 0; i < rows; ++i)
+    {
+        m_exemplarRanges.at<std::int32_t>(i) = exemplarRow;
+        for (const auto& exemplar : exemplars[i])
+        {
+            if (exemplar.size() != cols)
+                throw std::runtime_error("Gallery: embedding dimentions must be equal");
+
+            float* row = m_exemplars.ptr<float>(exemplarRow++);
+            std::copy(exemplar.begin(), exemplar.end(), row);
+            simdNormalize(row, cols);
+        }
+    }
+    m_exemplarRanges.at<std::int32_t>(rows) = exemplarRow;
+}
+
+Gallery::~Gallery() = default;
+
+void Gallery::save(const fs::path& filepath) const
+{
+    if (isFileStoragePath(filepath))
+        saveFileStorage(filepath);
+    else
+        saveBinary(filepath);
+}
+
+void Gallery::saveFileStorage(const fs::path& filepath) const
+{
+    cv::FileStorage fileStorage(filepath.string(), cv::FileStorage::WRITE);
+    if (!fileStorage.isOpened())
+        throw std::runtime_error("Gallery::save: Could not open " + filepath.string());
+
+    for (int i = 0; i < size(); ++i)
+        fileStorage << name(i) << m_embeddings.row(i);
+    fileStorage << "Names" << "[";
+    for (int i = 0; i < size(); ++i)
+        fileStorage << name(i);
+    fileStorage << "]";
+
+    if (!m_exemplars.empty())
+    {
+        fileStorage << "Exemplars" << "[";
+        for (int i = 0; i < size(); ++i)
+            fileStorage << m_exemplars.rowRange(
+                m_exemplarRanges.at<std::int32_t>(i), m_exemplarRanges.at<std::int32_t>(i + 1));
+        fileStorage << "]";
+    }
+}
+
+void Gallery::saveBinary(const fs::path& filepath) const
+{
+    /* Written aside and renamed over: processes that have the old file mapped keep a consistent copy */
+    replaceFile(filepath, [this, &filepath](const fs::path& tmpPath)
+    {
+        std::ofstream out(tmpPath, std::ios::binary);
+        if (!out.is_open())
+            throw std::runtime_error("Gallery::save: Could not open " + filepath.string());
+
+        const std::uint64_t count = size();
+        std::vector<std::uint64_t> nameOffsets(count + 1, 0);
+        std::string nameChars;
+        for (std::uint64_t i = 0; i < count; ++i)
+        {
+            nameChars += name(i);
+            nameOffsets[i + 1] = nameChars.size();
+        }
+
+        BinaryHeader header {};
+        std::memcpy(header.magic, BinaryMagic, sizeof(BinaryMagic));
+        header.version = BinaryVersion;
+        header.byteOrderMark = ByteOrderMark;
+        header.count = count;
+        header.dim = dim();
+
+        /* Sections go one after another, header is rewritten with their offsets at the end */
+        std::uint64_t position = 0;
+        const auto beginSection = [&out, &position]()
+        {
+            writePadding(out, position);
+            position = alignUp(position);
+            return position;
+        };
+        const auto writeBytes = [&out, &position](const void* data, std::uint64_t size)
+        {
+            out.write(static_cast<const char*>(data), size);
+            position += size;
+        };
+        const auto writeMat = [&writeBytes](const cv::Mat& mat)
+        {
+            for (int i = 0; i < mat.rows; ++i)
+                writeBytes(mat.ptr(i), mat.cols * mat.elemSize());
+        };
+
+        writeBytes(&header, sizeof(header));
+        header.namesOffset = beginSection();
+        writeBytes(nameOffsets.data(), nameOffsets.size() * sizeof(std::uint64_t));
+        writeBytes(nameChars.data(), nameChars.size());
+        header.namesSize = position - header.namesOffset;
+        header.embeddingsOffset = beginSection();
+        writeMat(m_embeddings);
+        if (!m_embeddingsF16.empty())
+        {
+            header.float16Offset = beginSection();
+            writeMat(m_embeddingsF16);
+        }
+        if (!m_embeddingsInt8.empty())
+        {
+            header.int8Offset = beginSection();
+            writeMat(m_embeddingsInt8);
+            header.int8ScalesOffset = beginSection();
+            writeMat(m_int8Scales);
+        }
+        if (!m_exemplars.empty())
+        {
+            header.exemplarCount = m_exemplars.rows;
+            header.exemplarsOffset = beginSection();
+            writeMat(m_exemplars);
+            header.exemplarRangesOffset = beginSection();
+            writeMat(m_exemplarRanges);
+        }
+
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.close();
+        if (!out)
+            throw std::runtime_error("Gallery::save: Failed to write " + filepath.string());
+    });
+}
+
+Gallery::Match Gallery::search(const std::vector<float>& embedding, float certainSimilarity) const
+{
+    const auto matches = searchTopK(embedding, 1, certainSimilarity);
+    return matches.empty() ? Match{-1, -1.0f} : matches[0];
+}
+
+std::vector<Gallery::Match> Gallery::searchTopK(
+    const std::vector<float>& embedding, int k, float certainSimilarity) const
+{
+    if (k <= 0)
+        throw std::runtime_error("Gallery::searchTopK: k must be positive");
+    if (!hasExemplars() || 0 == m_exemplarShortlist)
+        return searchCentroidsTopK(embedding, k, certainSimilarity);
+
+    const auto shortlist = searchCentroidsTopK(embedding, std::max(k, m_exemplarShortlist), certainSimilarity);
+    if (shortlist.empty())
+        return {};
+    std::vector<float> query(embedding);
+    simdNormalize(query.data(), query.size());
+    return rerankExemplars(query.data(), shortlist, k);
+}
+
+std::vector<Gallery::Match> Gallery::searchCentroidsTopK(
+    const std::vector<float>& embedding, int k, float certainSimilarity) const
+{
+    if (empty())
+        return {};
+    if (embedding.size() != dim())
+        throw std::runtime_error("Gallery::searchTopK: embedding dimentions must be equal");
+
+    const std::size_t cols = dim();
+    const float queryNorm = std::sqrt(simdDot(embedding.data(), embedding.data(), cols));
+    if (queryNorm <= 0.0f)
+        return {};
+
+    if (SearchBackend::Hnsw == m_searchBackend || Precision::Float32 != m_precision)
+    {
+        std::vector<float> query(embedding);
+        simdNormalize(query.data(), cols);
+        return (SearchBackend::Hnsw == m_searchBackend)
+            ? m_index->search(query.data(), k)
+            : searchQuantized(query.data(), k);
+    }
+
+    /* Rows are unit-length: compare raw dot products and divide by the query norm once at the end */
+    const float certainDot = certainSimilarity * queryNorm;
+    auto result = scanShards(k, [this, &embedding, cols, certainDot, k](int begin, int end, std::vector<Match>& heap)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            const auto dot = simdDot(m_embeddings.ptr<float>(i), embedding.data(), cols);
+            pushTopK(heap, k, {i, dot});
+            if (dot >= certainDot)
+                return true;
+        }
+        return false;
+    });
+
+    for (auto& match : result)
+        match.second /= queryNorm;
+    std::sort_heap(result.begin(), result.end(), worseMatch);
+    return result;
+}
+
+std::vector<Gallery::Match> Gallery::searchBatch(const Matr& queries, float certainSimilarity) const
+{
+    const auto topMatches = searchBatchTopK(queries, 1, certainSimilarity);
+    std::vector<Match> result;
+    result.reserve(topMatches.size());
+    for (const auto& matches : topMatches)
+        result.push_back(matches.empty() ? Match{-1, -1.0f} : matches[0]);
+    return result;
+}
+
+std::vector<std::vector<Gallery::Match>> Gallery::searchBatchTopK(
+    const Matr& queries, int k, float certainSimilarity) const
+{
+    if (queries.empty())
+        return {};
+    if (empty())
+        return std::vector<std::vector<Match>>(queries.size());
+
+    cv::Mat queriesMat(queries.size(), dim(), CV_32F);
+    for (int i = 0; i < queriesMat.rows; ++i)
+    {
+        if (queries[i].size() != dim())
+            throw std::runtime_error("Gallery::searchBatchTopK: embedding dimentions must be equal");
+        std::copy(queries[i].begin(), queries[i].end(), queriesMat.ptr<float>(i));
+    }
+    return searchBatchTopK(queriesMat, k, certainSimilarity);
+}
+
+std::vector<std::vector<Gallery::Match>> Gallery::searchBatchTopK(
+    const cv::Mat& queries, int k, float certainSimilarity) const
+{
+    if (k <= 0)
+        throw std::runtime_error("Gallery::searchBatchTopK: k must be positive");
+    if (!hasExemplars() || 0 == m_exemplarShortlist)
+        return searchCentroidsBatchTopK(queries, k, certainSimilarity);
+
+    auto result = searchCentroidsBatchTopK(queries, std::max(k, m_exemplarShortlist), certainSimilarity);
+    std::vector<float> query(dim());
+    for (int q = 0; q < static_cast<int>(result.size()); ++q)
+    {
+        if (result[q].empty())
+            continue;
+        std::copy(queries.ptr<float>(q), queries.ptr<float>(q) + dim(), query.begin());
+        simdNormalize(query.data(), query.size());
+        result[q] = rerankExemplars(query.data(), result[q], k);
+    }
+    return result;
+}
+
+std::vector<std::vector<Gallery::Match>> Gallery::searchCentroidsBatchTopK(
+    const cv::Mat& queries, int k, float certainSimilarity) const
+{
+    if (queries.empty())
+        return {};
+    if (empty())
+        return std::vector<std::vector<Match>>(queries.rows);
+    if (CV_32F != queries.type() || queries.cols != dim())
+        throw std::runtime_error("Gallery::searchBatchTopK: queries must be Q x dim() CV_32F matrix");
+
+    std::vector<std::vector<Match>> result(queries.rows);
+
+    /* Normalize queries once so that dot products are cosine similarities */
+    cv::Mat normQueries = queries.clone();
+    std::vector<bool> validQueries(normQueries.rows);
+    for (int q = 0; q < normQueries.rows; ++q)
+    {
+        float* row = normQueries.ptr<float>(q);
+        validQueries[q] = simdDot(row, row, normQueries.cols) > 0.0f;
+        simdNormalize(row, normQueries.cols);
+    }
+
+    if (SearchBackend::Hnsw == m_searchBackend || Precision::Float32 != m_precision)
+    {
+        parallelFor(normQueries.rows, [this, &normQueries, &validQueries, &result, k](int q, int)
+        {
+            if (!validQueries[q])
+                return;
+            result[q] = (SearchBackend::Hnsw == m_searchBackend)
+                ? m_index->search(normQueries.ptr<float>(q), k)
+                : searchQuantized(normQueries.ptr<float>(q), k);
+        });
+        return result;
+    }
+
+    /* Blocked Q x N similarity matrix: Q x B tile per gallery block, blocks are shared between threads */
+    const std::size_t kk = std::min(k, size());
+    const int nBlocks = (size() + GemmBlockRows - 1) / GemmBlockRows;
+    std::vector<std::vector<std::vector<Match>>> workerResults(
+        searchThreads(), std::vector<std::vector<Match>>(normQueries.rows));
+    std::vector<cv::Mat> workerScores(searchThreads());
+    std::atomic<bool> allCertain { false };
+    parallelFor(nBlocks, [&](int blockId, int workerId)
+    {
+        if (allCertain)
+            return;
+
+        auto& heaps = workerResults[workerId];
+        auto& scores = workerScores[workerId];
+        const int blockStart = blockId * GemmBlockRows;
+        const int blockEnd = std::min(blockStart + GemmBlockRows, size());
+        const cv::Mat block = m_embeddings.rowRange(blockStart, blockEnd);
+        cv::gemm(normQueries, block, 1.0, cv::noArray(), 0.0, scores, cv::GEMM_2_T);
+
+        bool certain = true;
+        for (int q = 0; q < scores.rows; ++q)
+        {
+            if (!validQueries[q])
+                continue;
+            const float* row = scores.ptr<float>(q);
+            for (int j = 0; j < scores.cols; ++j)
+                pushTopK(heaps[q], kk, {blockStart + j, row[j]});
+
+            certain = certain && std::any_of(heaps[q].begin(), heaps[q].end(),
+                [certainSimilarity](const Match& match) { return match.second >= certainSimilarity; });
+        }
+        if (certain)
+            allCertain = true;
+    });
+
+    result = std::move(workerResults[0]);
+    for (std::size_t w = 1; w < workerResults.size(); ++w)
+        for (int q = 0; q < normQueries.rows; ++q)
+            for (const auto& match : workerResults[w][q])
+                pushTopK(result[q], kk, match);
+    for (auto& matches : result)
+        std::sort_heap(matches.begin(), matches.end(), worseMatch);
+    return result;
+}
+
+std::vector<Gallery::Match> Gallery::searchQuantized(const float* normQuery, int k) const
+{
+    const std::size_t cols = dim();
+    const std::size_t nCandidates = std::min(std::max(k, m_rerankCandidates), size());
+
+    /* First pass on quantized copy */
+    std::vector<Match> candidates;
+    if (Precision::Int8 == m_precision)
+    {
+        std::vector<std::int8_t> query(cols);
+        const float queryScale = simdQuantizeInt8(normQuery, query.data(), cols);
+        const float* rowScales = m_int8Scales.ptr<float>();
+        candidates = scanShards(nCandidates, [&](int begin, int end, std::vector<Match>& heap)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                const auto dot = simdDotInt8(m_embeddingsInt8.ptr<std::int8_t>(i), query.data(), cols);
+                pushTopK(heap, nCandidates, {i, dot * rowScales[i] * queryScale});
+            }
+            return false;
+        });
+    }
+    else
+    {
+        candidates = scanShards(nCandidates, [&](int begin, int end, std::vector<Match>& heap)
+        {
+            for (int i = begin; i < end; ++i)
+                pushTopK(heap, nCandidates, {i, simdDotF16(normQuery, m_embeddingsF16.ptr<std::uint16_t>(i), cols)});
+            return false;
+        });
+    }
+
+    /* Re-rank with full precision */
+    std::vector<Match> result;
+    result.reserve(k);
+    for (const auto& candidate : candidates)
+        pushTopK(result, k, {candidate.first, simdDot(normQuery, m_embeddings.ptr<float>(candidate.first), cols)});
+    std::sort_heap(result.begin(), result.end(), worseMatch);
+    return result;
+}
+
+std::vector<Gallery::Match> Gallery::scanShards(int k, const ShardScan& scanShard) const
+{
+    std::vector<Match> result;
+    result.reserve(std::min(k, size()));
+    const int shardRows = std::max<int>(1, ShardBytes / (dim() * sizeof(float)));
+    const int nShards = (size() + shardRows - 1) / shardRows;
+    if (searchThreads() < 2 || nShards < 2)
+    {
+        scanShard(0, size(), result);
+        return result;
+    }
+
+    /* Every thread keeps its own top-k over all shards it took, then the heaps are merged */
+    std::vector<std::vector<Match>> workerHeaps(searchThreads());
+    std::atomic<bool> stop { false };
+    parallelFor(nShards, [&](int shard, int workerId)
+    {
+        if (stop)
+            return;
+        const int begin = shard * shardRows;
+        if (scanShard(begin, std::min(begin + shardRows, size()), workerHeaps[workerId]))
+            stop = true;
+    });
+
+    for (const auto& heap : workerHeaps)
+        for (const auto& match : heap)
+            pushTopK(result, k, match);
+    return result;
+}
+
+void Gallery::parallelFor(int nTasks, const std::function<void(int, int)>& task) const
+{
+    if (m_threadPool)
+    {
+        m_threadPool->parallelFor(nTasks, task);
+        return;
+    }
+    for (int i = 0; i < nTasks; ++i)
+        task(i, 0);
+}
+
+std::vector<Gallery::Match> Gallery::rerankExemplars(
+    const float* normQuery, const std::vector<Match>& shortlist, int k) const
+{
+    const std::size_t cols = dim();
+    std::vector<Match> result;
+    result.reserve(k);
+    for (const auto& candidate : shortlist)
+    {
+        float best = candidate.second;
+        const int end = m_exemplarRanges.at<std::int32_t>(candidate.first + 1);
+        for (int e = m_exemplarRanges.at<std::int32_t>(candidate.first); e < end; ++e)
+            best = std::max(best, simdDot(normQuery, m_exemplars.ptr<float>(e), cols));
+        pushTopK(result, k, {candidate.first, best});
+    }
+    std::sort_heap(result.begin(), result.end(), worseMatch);
+    return result;
+}
+
+void Gallery::setPrecision(Precision precision, int rerankCandidates)
+{
+    if (rerankCandidates < 1)
+        throw std::runtime_error("Gallery::setPrecision: rerankCandidates must be positive");
+
+    m_precision = precision;
+    m_rerankCandidates = rerankCandidates;
+    if (empty())
+        return;
+
+    if (Precision::Float16 == precision && m_embeddingsF16.empty())
+    {
+        m_embeddings.convertTo(m_embeddingsF16, CV_16F);
+    }
+    else if (Precision::Int8 == precision && m_embeddingsInt8.empty())
+    {
+        m_embeddingsInt8.create(size(), dim(), CV_8S);
+        m_int8Scales.create(size(), 1, CV_32F);
+        for (int i = 0; i < size(); ++i)
+            m_int8Scales.at<float>(i) = simdQuantizeInt8(
+                m_embeddings.ptr<float>(i), m_embeddingsInt8.ptr<std::int8_t>(i), dim());
+    }
+}
+
+Gallery::Precision Gallery::precision() const noexcept
+{
+    return m_precision;
+}
+
+void Gallery::buildIndex(const HnswIndex::Params& params)
+{
+    if (empty())
+        throw std::runtime_error("Gallery::buildIndex: Empty gallery");
+    m_index = std::make_shared<HnswIndex>(m_embeddings, params);
+    m_searchBackend = SearchBackend::Hnsw;
+}
+
+void Gallery::loadIndex(const fs::path& filepath)
+{
+    m_index = std::make_shared<HnswIndex>(HnswIndex::load(filepath, m_embeddings));
+    m_searchBackend = SearchBackend::Hnsw;
+}
+
+void Gallery::saveIndex(const fs::path& filepath) const
+{
+    if (!m_index)
+        throw std::runtime_error("Gallery::saveIndex: Index is not built");
+    m_index->save(filepath);
+}
+
+void Gallery::setExemplarShortlist(int shortlist)
+{
+    if (shortlist < 0)
+        throw std::runtime_error("Gallery::setExemplarShortlist: shortlist must be non-negative");
+    m_exemplarShortlist = shortlist;
+}
+
+bool Gallery::hasExemplars() const noexcept
+{
+    return !m_exemplars.empty();
+}
+
+void Gallery::setSearchThreads(int nThreads)
+{
+    if (nThreads < 1)
+        throw std::runtime_error("Gallery::setSearchThreads: nThreads must be positive");
+    m_threadPool = (nThreads > 1) ? std::make_shared<ThreadPool>(nThreads) : nullptr;
+}
+
+int Gallery::searchThreads() const noexcept
+{
+    return m_threadPool ? m_threadPool->size() : 1;
+}
+
+void Gallery::setEfSearch(int efSearch)
+{
+    if (m_index)
+        m_index->setEfSearch(efSearch);
+}
+
+void Gallery::setSearchBackend(SearchBackend backend)
+{
+    if (SearchBackend::Hnsw == backend && !m_index)
+        throw std::runtime_error("Gallery::setSearchBackend: Index is not built");
+    m_searchBackend = backend;
+}
+
+Gallery::SearchBackend Gallery::searchBackend() const noexcept
+{
+    return m_searchBackend;
+}
+
+bool Gallery::empty() const noexcept
+{
+    return m_embeddings.empty();
+}
+
+int Gallery::size() const noexcept
+{
+    return m_embeddings.rows;
+}
+
+int Gallery::dim() const noexcept
+{
+    return m_embeddings.cols;
+}
+
+std::string Gallery::name(int id) const
+{
+    if (id < 0 || id >= size())
+        throw std::out_of_range("Gallery::name: Invalid id");
+    if (m_nameOffsets)
+        return std::string(m_nameChars + m_nameOffsets[id], m_nameChars + m_nameOffsets[id + 1]);
+    return m_names[id];
+}
+
+const cv::Mat& Gallery::embeddings() const noexcept
+{
+    return m_embeddings;
+}
+
+
+std::pair<int, float> searchMostSimilarEmbedding(
+    const Gallery& gallery, const std::vector<float>& newComerEmbedding)
+{
+    return gallery.search(newComerEmbedding);
+}
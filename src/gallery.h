@@ -0,0 +1,213 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <limits>
+#include <memory>
+#include <functional>
+#include <utility>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include <opencv2/core.hpp>
+
+#include "math.h"
+#include "hnsw_index.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+/**
+ * @brief Person embeddings database.
+ * All embeddings live in a single contiguous row-major CV_32F matrix (64-byte aligned by cv::Mat allocator
+ * or by the binary file layout) and are L2-normalized once on construction, so cosine similarity reduces
+ * to a single dot product.
+ *
+ * A person may additionally keep several exemplar embeddings (different poses, lighting) besides the centroid.
+ * Search then runs in two stages: centroids are scored for the whole gallery, and exemplars are checked
+ * only for the best exemplarShortlist persons, whose score becomes the max over centroid and exemplars.
+ *
+ * With setSearchThreads() the gallery is scanned as cache-sized shards in parallel and per-thread top-k
+ * results are merged.
+ *
+ * Binary gallery file (little-endian, all sections 64-byte aligned):
+ *  - 128-byte header: magic "FRGALLRY", version, byte order mark, count, dim, section offsets;
+ *  - names: (count + 1) uint64 offsets into the following UTF-8 chars;
+ *  - embeddings: count x dim float32, unit-length rows;
+ *  - optional (version 2) quantized copies: count x dim float16, count x dim int8 + count float32 scales;
+ *  - optional (version 3) exemplars: exemplarCount x dim float32 unit-length rows grouped by person
+ *    + (count + 1) int32 offsets of each person's group.
+ * Binary galleries are memory-mapped and used zero-copy.
+ */
+class Gallery final
+{
+public:
+
+    using Match = std::pair<int, float>; // person id, cosine similarity
+
+    enum class SearchBackend
+    {
+        Exact,  // linear scan, always returns the true best match
+        Hnsw    // approximate graph search, sublinear in gallery size
+    };
+
+    enum class Precision
+    {
+        Float32,
+        Float16,    // first pass on half-precision copy, then float32 re-ranking
+        Int8        // first pass on int8 copy with per-vector scale, then float32 re-ranking
+    };
+
+    /**
+     * @brief Reads gallery written by FaceCollector: either binary gallery file (memory-mapped)
+     * or cv::FileStorage with "Names" sequence. Throws std::runtime_error if the file could not be read.
+     */
+    static Gallery load(const fs::path& filepath);
+
+    /**
+     * @brief Parses "f32", "f16" or "int8". Throws std::runtime_error on unknown value.
+     */
+    static Precision parsePrecision(const std::string& precision);
+
+    /**
+     * @brief Whether filepath is written as cv::FileStorage (.xml, .yml, .yaml, .json) rather than binary gallery.
+     */
+    static bool isFileStoragePath(const fs::path& filepath);
+
+    Gallery();
+    /**
+     * @brief exemplars is either empty or holds a (possibly empty) list of exemplar embeddings for every person.
+     */
+    Gallery(std::vector<std::string> names, const Matr& embeddings, const std::vector<Matr>& exemplars = {});
+    ~Gallery();
+
+    /**
+     * @brief Writes gallery in the format chosen by isFileStoragePath().
+     */
+    void save(const fs::path& filepath) const;
+
+    /**
+     * @brief Similarity no match can reach: disables early exit.
+     */
+    static constexpr float NeverCertain { std::numeric_limits<float>::infinity() };
+
+    /**
+     * @brief Finds the most similar person. Returns {-1, -1.0f} for an empty gallery.
+     * See searchTopK() for certainSimilarity.
+     */
+    Match search(const std::vector<float>& embedding, float certainSimilarity = NeverCertain) const;
+
+    /**
+     * @brief Finds k most similar persons sorted by descending similarity using a bounded heap.
+     * Exact float32 scan stops as soon as a match with similarity >= certainSimilarity is found,
+     * then the candidates collected so far are returned (ignored by quantized and HNSW search).
+     */
+    std::vector<Match> searchTopK(
+        const std::vector<float>& embedding, int k, float certainSimilarity = NeverCertain) const;
+
+    /**
+     * @brief Finds the most similar person for every query with one blocked matrix multiply.
+     * Gallery is streamed through cache once per call instead of once per query.
+     */
+    std::vector<Match> searchBatch(const Matr& queries, float certainSimilarity = NeverCertain) const;
+
+    /**
+     * @brief Finds k most similar persons (sorted by descending similarity) for every row
+     * of CV_32F queries matrix (Q x dim()). Exact float32 search stops after the gallery block
+     * in which every query got a match with similarity >= certainSimilarity.
+     */
+    std::vector<std::vector<Match>> searchBatchTopK(
+        const cv::Mat& queries, int k, float certainSimilarity = NeverCertain) const;
+    std::vector<std::vector<Match>> searchBatchTopK(
+        const Matr& queries, int k, float certainSimilarity = NeverCertain) const;
+
+    /**
+     * @brief Builds HNSW graph over the gallery and switches search to SearchBackend::Hnsw.
+     */
+    void buildIndex(const HnswIndex::Params& params);
+
+    /**
+     * @brief Reads HNSW graph saved with saveIndex() and switches search to SearchBackend::Hnsw.
+     */
+    void loadIndex(const fs::path& filepath);
+    void saveIndex(const fs::path& filepath) const;
+
+    /**
+     * @brief Selects precision of the exact search first pass. Quantized copy is taken from the binary gallery
+     * file if it was saved there, otherwise computed. rerankCandidates best first-pass candidates are re-scored
+     * with float32 vectors, so only a few float32 rows are touched per query.
+     * Quantized copies present when the gallery is saved are written to the binary file.
+     */
+    void setPrecision(Precision precision, int rerankCandidates = 32);
+    Precision precision() const noexcept;
+
+    /**
+     * @brief Number of best centroid matches whose exemplars are checked, 0 disables the second stage.
+     * At least k persons are always checked.
+     */
+    void setExemplarShortlist(int shortlist);
+    bool hasExemplars() const noexcept;
+
+    /**
+     * @brief Number of threads (including the caller) sharing a search, 1 disables parallel search.
+     * Keep nThreads + LibTorch / OpenCV threads within the physical core count: the pools run one after
+     * another per frame, but oversubscribed cores still slow down both.
+     */
+    void setSearchThreads(int nThreads);
+    int searchThreads() const noexcept;
+
+    void setEfSearch(int efSearch);
+    void setSearchBackend(SearchBackend backend);
+    SearchBackend searchBackend() const noexcept;
+
+    bool empty() const noexcept;
+    int size() const noexcept;
+    int dim() const noexcept;
+
+    std::string name(int id) const;
+
+    /**
+     * @brief size() x dim() CV_32F matrix of unit-length embeddings.
+     */
+    const cv::Mat& embeddings() const noexcept;
+
+private:
+    using ShardScan = std::function<bool(int, int, std::vector<Match>&)>;
+
+    static Gallery loadFileStorage(const fs::path& filepath);
+    static Gallery loadBinary(const fs::path& filepath);
+    void saveFileStorage(const fs::path& filepath) const;
+    void saveBinary(const fs::path& filepath) const;
+    std::vector<Match> searchCentroidsTopK(
+        const std::vector<float>& embedding, int k, float certainSimilarity) const;
+    std::vector<std::vector<Match>> searchCentroidsBatchTopK(
+        const cv::Mat& queries, int k, float certainSimilarity) const;
+    std::vector<Match> searchQuantized(const float* normQuery, int k) const;
+    std::vector<Match> scanShards(int k, const ShardScan& scanShard) const;
+    void parallelFor(int nTasks, const std::function<void(int, int)>& task) const;
+    std::vector<Match> rerankExemplars(const float* normQuery, const std::vector<Match>& shortlist, int k) const;
+
+    std::vector<std::string> m_names;
+    cv::Mat m_embeddings;
+    cv::Mat m_embeddingsF16;    // CV_16F
+    cv::Mat m_embeddingsInt8;   // CV_8S
+    cv::Mat m_int8Scales;       // size() x 1 CV_32F
+    Precision m_precision { Precision::Float32 };
+    int m_rerankCandidates { 32 };
+    cv::Mat m_exemplars;        // CV_32F, rows grouped by person
+    cv::Mat m_exemplarRanges;   // (size() + 1) x 1 CV_32S, person i owns rows [range[i], range[i + 1])
+    int m_exemplarShortlist { 8 };
+
+    /* Binary gallery: names and embeddings point into the mapping */
+    std::shared_ptr<MappedFile> m_mappedFile;
+    const std::uint64_t* m_nameOffsets { nullptr };
+    const char* m_nameChars { nullptr };
+
+    std::shared_ptr<ThreadPool> m_threadPool;
+
+    SearchBackend m_searchBackend { SearchBackend::Exact };
+    std::shared_ptr<HnswIndex> m_index;
+};
+
+std::pair<int, float> searchMostSimilarEmbedding(
+    const Gallery& gallery, const std::vector<float>& newComerEmbedding);
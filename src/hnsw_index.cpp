@@ -0,0 +1,400 @@
+#include <cmath>
+#include <queue>
+#include <cstdint>
+#include <random>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include "simd.h"
+#include "hnsw_index.h"
+#include "mapped_file.h"
+
+namespace
+{
+
+constexpr char Magic[8] = { 'F', 'R', 'H', 'N', 'S', 'W', '0', '1' };
+constexpr unsigned RandomSeed { 42 };
+
+struct CloserFirst
+{
+    bool operator()(const HnswIndex::Match& a, const HnswIndex::Match& b) const { return a.second < b.second; }
+};
+struct FartherFirst
+{
+    bool operator()(const HnswIndex::Match& a, const HnswIndex::Match& b) const { return a.second > b.second; }
+};
+
+/* Epoch-tagged visited set, reused between searches of the same thread */
+struct VisitedSet
+{
+    std::vector<unsigned> tags;
+    unsigned epoch { 0 };
+
+    void reset(std::size_t n)
+    {
+        if (tags.size() < n)
+            tags.resize(n, 0);
+        if (0 == ++epoch)
+        {
+            std::fill(tags.begin(), tags.end(), 0);
+            epoch = 1;
+        }
+    }
+    bool visit(int id)
+    {
+        if (epoch == tags[id])
+            return false;
+        tags[id] = epoch;
+        return true;
+    }
+};
+
+thread_local VisitedSet visitedSet;
+
+template<typename T>
+void writePod(std::ofstream& out, const T& value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+void readPod(std::ifstream& in, T& value)
+{
+    in.read(reinterpret_cast<char*>(&value), sizeof(T));
+    if (!in)
+        throw std::runtime_error("HnswIndex::load: Unexpected end of file");
+}
+
+void writeInts(std::ofstream& out, const std::vector<int>& values)
+{
+    writePod(out, static_cast<std::int64_t>(values.size()));
+    out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(int));
+}
+
+void readInts(std::ifstream& in, std::vector<int>& values)
+{
+    std::int64_t count = 0;
+    readPod(in, count);
+    if (count < 0)
+        throw std::runtime_error("HnswIndex::load: Data invalid");
+    values.resize(count);
+    in.read(reinterpret_cast<char*>(values.data()), count * sizeof(int));
+    if (!in)
+        throw std::runtime_error("HnswIndex::load: Unexpected end of file");
+}
+
+}
+
+HnswIndex HnswIndex::load(const fs::path& filepath, const cv::Mat& data)
+{
+    std::ifstream in(filepath, std::ios::binary);
+    if (!in.is_open())
+        throw std::runtime_error("HnswIndex::load: Could not open " + filepath.string());
+
+    char magic[sizeof(Magic)];
+    in.read(magic, sizeof(magic));
+    if (!in || !std::equal(magic, magic + sizeof(Magic), Magic))
+        throw std::runtime_error("HnswIndex::load: Not an hnsw index file");
+
+    std::int32_t rows = 0, cols = 0;
+    HnswIndex index;
+    readPod(in, rows);
+    readPod(in, cols);
+    readPod(in, index.m_params.M);
+    readPod(in, index.m_params.efConstruction);
+    readPod(in, index.m_maxLevel);
+    readPod(in, index.m_entryPoint);
+    if (rows != data.rows || cols != data.cols || CV_32F != data.type())
+        throw std::runtime_error("HnswIndex::load: Index was built for another gallery");
+    if (index.m_params.M < 2 || index.m_params.efConstruction < 1 || rows <= 0
+        || index.m_maxLevel < 0 || index.m_entryPoint < 0 || index.m_entryPoint >= rows)
+        throw std::runtime_error("HnswIndex::load: Data invalid");
+
+    readInts(in, index.m_levels);
+    readInts(in, index.m_links0);
+    index.m_upperLinks.resize(rows);
+    for (auto& upperLinks : index.m_upperLinks)
+        readInts(in, upperLinks);
+
+    if (index.m_levels.size() != rows
+        || index.m_links0.size() != static_cast<std::size_t>(rows) * (index.maxLinks(0) + 1)
+        || index.m_levels[index.m_entryPoint] != index.m_maxLevel)
+        throw std::runtime_error("HnswIndex::load: Data invalid");
+
+    /* search() follows links without bounds checks: every list must fit its node and point at existing nodes */
+    for (int id = 0; id < rows; ++id)
+    {
+        const int level = index.m_levels[id];
+        if (level < 0 || level > index.m_maxLevel
+            || index.m_upperLinks[id].size() != static_cast<std::size_t>(level) * (index.maxLinks(1) + 1))
+            throw std::runtime_error("HnswIndex::load: Data invalid");
+
+        for (int l = 0; l <= level; ++l)
+        {
+            const int* neighbors = index.links(id, l);
+            if (neighbors[0] < 0 || neighbors[0] > index.maxLinks(l))
+                throw std::runtime_error("HnswIndex::load: Data invalid");
+            for (int i = 1; i <= neighbors[0]; ++i)
+                if (neighbors[i] < 0 || neighbors[i] >= rows)
+                    throw std::runtime_error("HnswIndex::load: Data invalid");
+        }
+    }
+
+    index.m_data = data;
+    return index;
+}
+
+HnswIndex::HnswIndex() = default;
+
+HnswIndex::HnswIndex(const cv::Mat& data, Params params)
+    : m_params(params)
+    , m_data(data)
+{
+    if (data.empty() || CV_32F != data.type())
+        throw std::runtime_error("HnswIndex: data must be non-empty CV_32F matrix");
+    if (m_params.M < 2 || m_params.efConstruction < 1 || m_params.efSearch < 1)
+        throw std::runtime_error("HnswIndex: Invalid params");
+
+    const int n = data.rows;
+    m_levels.resize(n);
+    m_links0.assign(static_cast<std::size_t>(n) * (maxLinks(0) + 1), 0);
+    m_upperLinks.resize(n);
+
+    std::mt19937 rng(RandomSeed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    const double levelMult = 1.0 / std::log(static_cast<double>(m_params.M));
+    for (int id = 0; id < n; ++id)
+    {
+        const int level = static_cast<int>(-std::log(1.0 - uniform(rng)) * levelMult);
+        m_levels[id] = level;
+        m_upperLinks[id].assign(static_cast<std::size_t>(level) * (maxLinks(1) + 1), 0);
+        insert(id, level);
+    }
+}
+
+HnswIndex::~HnswIndex() = default;
+
+void HnswIndex::save(const fs::path& filepath) const
+{
+    /* Recognizers loading the index while it is rebuilt see either the old or the new file, never a partial one */
+    replaceFile(filepath, [this, &filepath](const fs::path& tmpPath)
+    {
+        std::ofstream out(tmpPath, std::ios::binary);
+        if (!out.is_open())
+            throw std::runtime_error("HnswIndex::save: Could not open " + filepath.string());
+
+        out.write(Magic, sizeof(Magic));
+        writePod(out, static_cast<std::int32_t>(m_data.rows));
+        writePod(out, static_cast<std::int32_t>(m_data.cols));
+        writePod(out, m_params.M);
+        writePod(out, m_params.efConstruction);
+        writePod(out, m_maxLevel);
+        writePod(out, m_entryPoint);
+        writeInts(out, m_levels);
+        writeInts(out, m_links0);
+        for (const auto& upperLinks : m_upperLinks)
+            writeInts(out, upperLinks);
+        out.close();
+        if (!out)
+            throw std::runtime_error("HnswIndex::save: Failed to write " + filepath.string());
+    });
+}
+
+std::vector<HnswIndex::Match> HnswIndex::search(const float* query, int k) const
+{
+    if (empty() || k <= 0)
+        return {};
+
+    const int entryPoint = greedyClosest(query, m_entryPoint, m_maxLevel, 1);
+    auto result = searchLayer(query, entryPoint, std::max(m_params.efSearch, k), 0);
+    std::sort(result.begin(), result.end(), FartherFirst());
+    if (result.size() > k)
+        result.resize(k);
+    return result;
+}
+
+void HnswIndex::setEfSearch(int efSearch)
+{
+    m_params.efSearch = std::max(1, efSearch);
+}
+
+const HnswIndex::Params& HnswIndex::params() const noexcept
+{
+    return m_params;
+}
+
+bool HnswIndex::empty() const noexcept
+{
+    return m_entryPoint < 0;
+}
+
+float HnswIndex::similarity(const float* query, int id) const
+{
+    return simdDot(query, m_data.ptr<float>(id), m_data.cols);
+}
+
+int HnswIndex::maxLinks(int level) const noexcept
+{
+    return (0 == level) ? 2 * m_params.M : m_params.M;
+}
+
+int* HnswIndex::links(int id, int level)
+{
+    if (0 == level)
+        return &m_links0[static_cast<std::size_t>(id) * (maxLinks(0) + 1)];
+    return &m_upperLinks[id][static_cast<std::size_t>(level - 1) * (maxLinks(1) + 1)];
+}
+
+const int* HnswIndex::links(int id, int level) const
+{
+    return const_cast<HnswIndex*>(this)->links(id, level);
+}
+
+int HnswIndex::greedyClosest(const float* query, int entryPoint, int fromLevel, int toLevel) const
+{
+    int current = entryPoint;
+    float currentSim = similarity(query, current);
+    for (int level = fromLevel; level >= toLevel; --level)
+    {
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            const int* neighbors = links(current, level);
+            for (int i = 1; i <= neighbors[0]; ++i)
+            {
+                const float sim = similarity(query, neighbors[i]);
+                if (sim > currentSim)
+                {
+                    currentSim = sim;
+                    current = neighbors[i];
+                    changed = true;
+                }
+            }
+        }
+    }
+    return current;
+}
+
+std::vector<HnswIndex::Match> HnswIndex::searchLayer(
+    const float* query, int entryPoint, int ef, int level) const
+{
+    visitedSet.reset(m_data.rows);
+    visitedSet.visit(entryPoint);
+
+    std::priority_queue<Match, std::vector<Match>, CloserFirst> candidates; // best on top
+    std::priority_queue<Match, std::vector<Match>, FartherFirst> found;     // worst on top
+    const Match entry { entryPoint, similarity(query, entryPoint) };
+    candidates.push(entry);
+    found.push(entry);
+
+    while (!candidates.empty())
+    {
+        const auto candidate = candidates.top();
+        if (candidate.second < found.top().second && found.size() >= ef)
+            break;
+        candidates.pop();
+
+        const int* neighbors = links(candidate.first, level);
+        for (int i = 1; i <= neighbors[0]; ++i)
+        {
+            const int neighbor = neighbors[i];
+            if (!visitedSet.visit(neighbor))
+                continue;
+
+            const float sim = similarity(query, neighbor);
+            if (found.size() < ef || sim > found.top().second)
+            {
+                candidates.emplace(neighbor, sim);
+                found.emplace(neighbor, sim);
+                if (found.size() > ef)
+                    found.pop();
+            }
+        }
+    }
+
+    std::vector<Match> result;
+    result.reserve(found.size());
+    for (; !found.empty(); found.pop())
+        result.push_back(found.top());
+    return result;
+}
+
+void HnswIndex::selectNeighbors(std::vector<Match>& candidates, int maxCount) const
+{
+    /* Keep a candidate only if it is closer to the base point than to any already kept neighbor.
+       This keeps links spread over different directions and the graph navigable. */
+    std::sort(candidates.begin(), candidates.end(), FartherFirst());
+    std::vector<Match> selected;
+    selected.reserve(maxCount);
+    for (const auto& candidate : candidates)
+    {
+        if (selected.size() >= maxCount)
+            break;
+
+        const float* candidateVec = m_data.ptr<float>(candidate.first);
+        const bool diverse = std::none_of(selected.begin(), selected.end(),
+            [&](const Match& kept) { return similarity(candidateVec, kept.first) > candidate.second; });
+        if (diverse)
+            selected.push_back(candidate);
+    }
+    candidates = std::move(selected);
+}
+
+void HnswIndex::insert(int id, int level)
+{
+    if (m_entryPoint < 0)
+    {
+        m_entryPoint = id;
+        m_maxLevel = level;
+        return;
+    }
+
+    const float* query = m_data.ptr<float>(id);
+    int entryPoint = m_entryPoint;
+    if (level < m_maxLevel)
+        entryPoint = greedyClosest(query, entryPoint, m_maxLevel, level + 1);
+
+    for (int lc = std::min(level, m_maxLevel); lc >= 0; --lc)
+    {
+        auto candidates = searchLayer(query, entryPoint, m_params.efConstruction, lc);
+        entryPoint = std::max_element(candidates.begin(), candidates.end(), CloserFirst())->first;
+
+        selectNeighbors(candidates, m_params.M);
+        int* idLinks = links(id, lc);
+        idLinks[0] = candidates.size();
+        for (std::size_t i = 0; i < candidates.size(); ++i)
+            idLinks[i + 1] = candidates[i].first;
+
+        /* Link back, shrinking neighbor lists that overflow */
+        const int levelMaxLinks = maxLinks(lc);
+        for (const auto& candidate : candidates)
+        {
+            int* neighborLinks = links(candidate.first, lc);
+            if (neighborLinks[0] < levelMaxLinks)
+            {
+                neighborLinks[++neighborLinks[0]] = id;
+                continue;
+            }
+
+            const float* neighborVec = m_data.ptr<float>(candidate.first);
+            std::vector<Match> neighborCandidates;
+            neighborCandidates.reserve(levelMaxLinks + 1);
+            neighborCandidates.emplace_back(id, candidate.second);
+            for (int i = 1; i <= neighborLinks[0]; ++i)
+                neighborCandidates.emplace_back(neighborLinks[i], similarity(neighborVec, neighborLinks[i]));
+            selectNeighbors(neighborCandidates, levelMaxLinks);
+
+            neighborLinks[0] = neighborCandidates.size();
+            for (std::size_t i = 0; i < neighborCandidates.size(); ++i)
+                neighborLinks[i + 1] = neighborCandidates[i].first;
+        }
+    }
+
+    if (level > m_maxLevel)
+    {
+        m_maxLevel = level;
+        m_entryPoint = id;
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include <opencv2/core.hpp>
+
+/**
+ * @brief Hierarchical Navigable Small World graph (Malkov & Yashunin, 2016) for approximate
+ * maximum inner product search over unit-length embeddings.
+ * The index does not copy vectors, it keeps a reference to the CV_32F data matrix it was built on.
+ */
+class HnswIndex final
+{
+public:
+
+    using Match = std::pair<int, float>; // row id, cosine similarity
+
+    struct Params
+    {
+        int M { 16 };                   // links per node on upper layers (2*M on layer 0)
+        int efConstruction { 200 };     // candidate list size while building
+        int efSearch { 64 };            // candidate list size while searching: higher is slower but more accurate
+    };
+
+    /**
+     * @brief Reads graph saved with save(). data must be the same matrix the graph was built on.
+     * Throws std::runtime_error on invalid file.
+     */
+    static HnswIndex load(const fs::path& filepath, const cv::Mat& data);
+
+    HnswIndex();
+    HnswIndex(const cv::Mat& data, Params params);
+    ~HnswIndex();
+
+    void save(const fs::path& filepath) const;
+
+    /**
+     * @brief Returns k approximate nearest rows sorted by descending similarity. query must be unit-length.
+     */
+    std::vector<Match> search(const float* query, int k) const;
+
+    void setEfSearch(int efSearch);
+    const Params& params() const noexcept;
+    bool empty() const noexcept;
+
+private:
+    float similarity(const float* query, int id) const;
+    int maxLinks(int level) const noexcept;
+    int* links(int id, int level);
+    const int* links(int id, int level) const;
+
+    int greedyClosest(const float* query, int entryPoint, int fromLevel, int toLevel) const;
+    std::vector<Match> searchLayer(const float* query, int entryPoint, int ef, int level) const;
+    void selectNeighbors(std::vector<Match>& candidates, int maxCount) const;
+    void insert(int id, int level);
+
+    Params m_params;
+    cv::Mat m_data;
+    int m_maxLevel { -1 };
+    int m_entryPoint { -1 };
+    std::vector<int> m_levels;
+    std::vector<int> m_links0;                  // layer 0: [count, ids...] per node, flat
+    std::vector<std::vector<int>> m_upperLinks; // layers 1..level: [count, ids...] per layer
+};
@@ -0,0 +1,510 @@
+#include <thread>
+#include <functional>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <opencv2/dnn.hpp>
+
+#include <torch/script.h>
+#include <torch/cuda.h>
+#include <torch/version.h>
+
+#ifdef WITH_ONNXRUNTIME
+#include <onnxruntime_cxx_api.h>
+#endif
+
+#include "inference_backend.h"
+#include "mapped_file.h"
+
+namespace
+{
+
+std::vector<std::int64_t> blobShape(const cv::Mat& blob)
+{
+    if (blob.empty() || CV_32F != blob.depth() || !blob.isContinuous())
+        throw std::runtime_error("infer: Expected continuous CV_32F blob");
+    return std::vector<std::int64_t>(blob.size.p, blob.size.p + blob.dims);
+}
+
+/* Optimized model in cacheDir, named after the source model and everything the optimized graph depends on */
+fs::path cachedModelPath(const fs::path& modelpath, const fs::path& cacheDir, const std::string& tag)
+{
+    if (cacheDir.empty())
+        return {};
+    return cacheDir / (modelpath.stem().string() + "." + tag + modelpath.extension().string());
+}
+
+/* Identity of the source model a cache was made from: size and mtime, empty if the model can not be read */
+std::string sourceStamp(const fs::path& modelpath)
+{
+    std::error_code error;
+    const auto size = fs::file_size(modelpath, error);
+    if (error)
+        return {};
+    const auto mtime = fs::last_write_time(modelpath, error);
+    if (error)
+        return {};
+    return std::to_string(size) + " " + std::to_string(mtime.time_since_epoch().count());
+}
+
+fs::path stampPath(const fs::path& cachePath)
+{
+    return fs::path(cachePath).concat(".source");
+}
+
+/* Exact match, not "newer than": a model replaced by an older file (cp -p, backup restore) is optimized again */
+bool isFreshCache(const fs::path& cachePath, const fs::path& modelpath)
+{
+    std::error_code error;
+    if (cachePath.empty() || !fs::exists(cachePath, error) || error)
+        return false;
+
+    const auto stamp = sourceStamp(modelpath);
+    std::ifstream in(stampPath(cachePath));
+    std::string cachedStamp;
+    return !stamp.empty() && std::getline(in, cachedStamp) && stamp == cachedStamp;
+}
+
+void writeStamp(const fs::path& cachePath, const std::string& stamp)
+{
+    replaceFile(stampPath(cachePath), [&stamp](const fs::path& tmpPath)
+    {
+        std::ofstream out(tmpPath);
+        out << stamp << std::endl;
+        out.close();
+        if (!out)
+            throw std::runtime_error("Failed to write " + tmpPath.string());
+    });
+}
+
+/* Writes through a temporary file, so concurrently starting processes never read a half-written cache.
+   Failures are reported and leave no cache: next start optimizes again */
+void writeCache(const fs::path& cachePath, const fs::path& modelpath, const std::function<void(const fs::path&)>& write)
+{
+    try
+    {
+        const auto stamp = sourceStamp(modelpath);
+        if (stamp.empty())
+            return;
+        fs::create_directories(cachePath.parent_path());
+        replaceFile(cachePath, write);
+        writeStamp(cachePath, stamp);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "InferenceBackend: Could not write model cache " << cachePath << ":\n" << e.what() << std::endl;
+    }
+}
+
+/* cv::dnn, optionally with the Inference Engine (OpenVINO) backend */
+class OpenCvDnnBackend final : public InferenceBackend
+{
+public:
+    OpenCvDnnBackend(const fs::path& modelpath, const Options& options, bool openVino)
+        : m_type((openVino) ? Type::OpenVino : Type::OpenCvDnn)
+    {
+        m_net = cv::dnn::readNet(modelpath.string());
+        if (openVino)
+        {
+            m_net.setPreferableBackend(cv::dnn::DNN_BACKEND_INFERENCE_ENGINE);
+            m_net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+        }
+        else if (options.enableGpu) // dummy-style without checking GPU availability.
+        {
+            m_net.setPreferableBackend(cv::dnn::DNN_BACKEND_CUDA);
+            m_net.setPreferableTarget(cv::dnn::DNN_TARGET_CUDA);
+        }
+        m_outputNames = m_net.getUnconnectedOutLayersNames();
+    }
+
+    Type type() const noexcept override
+    {
+        return m_type;
+    }
+
+    void infer(const cv::Mat& blob, std::vector<cv::Mat>& outputs) override
+    {
+        m_net.setInput(blob);
+        m_net.forward(outputs, m_outputNames);
+    }
+
+private:
+    Type m_type;
+    cv::dnn::Net m_net;
+    std::vector<std::string> m_outputNames;
+};
+
+/* TorchScript module */
+class LibTorchBackend final : public InferenceBackend
+{
+public:
+    LibTorchBackend(const fs::path& modelpath, const Options& options)
+        : m_options(options)
+        , m_device(torch::DeviceType::CPU)
+    {
+        /* Check CUDA availability */
+        if (m_options.enableGpu)
+        {
+            if (m_options.quantized)
+                std::cout << "LibTorchBackend: int8 model runs on CPU only! Switching calculations to CPU ..." << std::endl;
+            else if (!torch::cuda::is_available())
+                std::cout << "LibTorchBackend: LibTorch CUDA is not available! Switching calculations to CPU ..." << std::endl;
+            else
+                m_device = torch::DeviceType::CUDA;
+        }
+
+        /* Quantized kernels: fbgemm on x86, qnnpack on ARM */
+        if (m_options.quantized)
+        {
+            const auto& engines = at::globalContext().supportedQEngines();
+            for (const auto engine : { at::QEngine::FBGEMM, at::QEngine::QNNPACK })
+            {
+                if (std::find(engines.begin(), engines.end(), engine) != engines.end())
+                {
+                    at::globalContext().setQEngine(engine);
+                    break;
+                }
+            }
+        }
+
+        /* Thread budget: without it LibTorch takes all cores and competes with detection and gallery search */
+        applyIntraOpThreads(); // for optimization passes below; infer() repeats it on the inferring thread
+        if (m_options.interOpThreads > 0)
+        {
+            try
+            {
+                torch::set_num_interop_threads(m_options.interOpThreads);
+            }
+            catch(const torch::Error&)
+            {
+                // already set by an earlier model or after inter-op work started
+            }
+        }
+
+        /* Frozen and optimized module saved by an earlier run skips re-optimization */
+        const auto cachePath = (m_options.optimize) ? cachedModelPath(modelpath, m_options.cacheDir, cacheTag()) : fs::path();
+        if (isFreshCache(cachePath, modelpath))
+        {
+            try
+            {
+                m_model = torch::jit::load(cachePath.string(), m_device);
+                return;
+            }
+            catch(const torch::Error& e)
+            {
+                std::cerr << "LibTorchBackend: Could not read cached model, optimizing again:\n" << e.what() << std::endl;
+            }
+        }
+
+        try
+        {
+            // De-serialize ScriptModule from file
+            m_model = torch::jit::load(modelpath.string(), m_device);
+        }
+        catch(const torch::Error& e)
+        {
+            throw std::runtime_error(std::string("LibTorchBackend: Could not read model:\n") + e.what());
+        }
+
+        if (!m_options.optimize)
+        {
+            if (m_options.bfloat16)
+                m_model.to(torch::kBFloat16);
+        }
+        else if (optimizeModel() && !cachePath.empty())
+        {
+            writeCache(cachePath, modelpath, [this](const fs::path& filepath) { m_model.save(filepath.string()); });
+        }
+    }
+
+    Type type() const noexcept override
+    {
+        return Type::LibTorch;
+    }
+
+    void infer(const cv::Mat& blob, std::vector<cv::Mat>& outputs) override
+    {
+        applyIntraOpThreads();
+        const auto input = torch::from_blob(const_cast<float*>(blob.ptr<float>()), blobShape(blob), torch::kFloat);
+
+        c10::InferenceMode inferenceMode; // no autograd bookkeeping or version counters
+        std::vector<torch::jit::IValue> inputs;
+        if (m_options.bfloat16)
+            inputs.emplace_back(input.to(m_device, torch::kBFloat16));
+        else
+            inputs.emplace_back((torch::kCPU == m_device) ? input : input.to(m_device));
+
+        /* Infer */
+        const auto y = m_model.forward(inputs);
+        m_outputs.clear();
+        if (y.isTuple())
+        {
+            for (const auto& element : y.toTuple()->elements())
+                if (element.isTensor())
+                    m_outputs.push_back(toDenseCpu(element.toTensor()));
+        }
+        else if (y.isTensor())
+        {
+            m_outputs.push_back(toDenseCpu(y.toTensor()));
+        }
+
+        /* Outputs are only read before the next forward: no clone, wrap tensor memory */
+        outputs.resize(m_outputs.size());
+        for (std::size_t i = 0; i < m_outputs.size(); ++i)
+        {
+            const std::vector<int> sizes(m_outputs[i].sizes().begin(), m_outputs[i].sizes().end());
+            outputs[i] = cv::Mat(sizes.size(), sizes.data(), CV_32F, m_outputs[i].data_ptr<float>());
+        }
+    }
+
+private:
+    /* With OpenMP the intra-op thread count is per thread: the model may be loaded in background and run elsewhere */
+    void applyIntraOpThreads()
+    {
+        if (m_options.intraOpThreads <= 0 || std::this_thread::get_id() == m_threadsAppliedTo)
+            return;
+        torch::set_num_threads(m_options.intraOpThreads);
+        m_threadsAppliedTo = std::this_thread::get_id();
+    }
+
+    static torch::Tensor toDenseCpu(const torch::Tensor& tensor)
+    {
+        return tensor.to(torch::kCPU, torch::kFloat).contiguous();
+    }
+
+    /* Everything the optimized graph depends on */
+    std::string cacheTag() const
+    {
+        std::string tag = std::string("torch") + TORCH_VERSION;
+        if (torch::kCUDA == m_device)
+            tag += ".cuda";
+        if (m_options.bfloat16)
+            tag += ".bf16";
+        if (m_options.quantized)
+            tag += ".int8";
+        return tag;
+    }
+
+    bool optimizeModel()
+    {
+        try
+        {
+            m_model.eval();
+            if (m_options.bfloat16)
+                m_model.to(torch::kBFloat16);
+            m_model = torch::jit::freeze(m_model);
+            if (torch::kCPU == m_device && !m_options.quantized)
+                m_model = torch::jit::optimize_for_inference(m_model);
+            return true;
+        }
+        catch(const torch::Error& e)
+        {
+            std::cerr << "LibTorchBackend: Could not optimize model, running it as is:\n" << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    Options m_options;
+    torch::DeviceType m_device;
+    torch::jit::script::Module m_model;
+    std::thread::id m_threadsAppliedTo; // thread the intra-op count was last set on
+    std::vector<torch::Tensor> m_outputs;
+};
+
+#ifdef WITH_ONNXRUNTIME
+/* ONNX Runtime session on the default (CPU) execution provider */
+class OnnxRuntimeBackend final : public InferenceBackend
+{
+public:
+    OnnxRuntimeBackend(const fs::path& modelpath, const Options& options)
+        : m_env(ORT_LOGGING_LEVEL_WARNING, "FaceRecognizer")
+        , m_memoryInfo(Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault))
+    {
+        bool sessionCreated = false;
+        const auto createSession = [this, &options, &sessionCreated](
+            const fs::path& loadPath, GraphOptimizationLevel level, const fs::path& optimizedPath)
+        {
+            Ort::SessionOptions sessionOptions;
+            if (options.intraOpThreads > 0)
+                sessionOptions.SetIntraOpNumThreads(options.intraOpThreads);
+            if (options.interOpThreads > 0)
+                sessionOptions.SetInterOpNumThreads(options.interOpThreads);
+            sessionOptions.SetGraphOptimizationLevel(level);
+            if (!optimizedPath.empty())
+                sessionOptions.SetOptimizedModelFilePath(optimizedPath.c_str());
+            try
+            {
+                m_session = Ort::Session(m_env, loadPath.c_str(), sessionOptions);
+                sessionCreated = true;
+            }
+            catch(const Ort::Exception& e)
+            {
+                throw std::runtime_error(std::string("OnnxRuntimeBackend: Could not read model:\n") + e.what());
+            }
+        };
+
+        /* Graph optimized by an earlier run is loaded as is, otherwise ONNX Runtime writes it out while optimizing.
+           ORT_ENABLE_ALL output may hold layouts specific to this CPU, so cacheDir should be local to the host */
+        const auto cachePath = (options.optimize)
+            ? cachedModelPath(modelpath, options.cacheDir, std::string("ort") + OrtGetApiBase()->GetVersionString()) : fs::path();
+        if (!options.optimize)
+        {
+            createSession(modelpath, GraphOptimizationLevel::ORT_DISABLE_ALL, {});
+        }
+        else if (isFreshCache(cachePath, modelpath))
+        {
+            createSession(cachePath, GraphOptimizationLevel::ORT_DISABLE_ALL, {});
+        }
+        else
+        {
+            if (!cachePath.empty())
+            {
+                writeCache(cachePath, modelpath, [&createSession, &modelpath](const fs::path& tmpPath)
+                {
+                    createSession(modelpath, GraphOptimizationLevel::ORT_ENABLE_ALL, tmpPath);
+                });
+            }
+            if (!sessionCreated) // no cache dir, or writing the cache failed: load without writing the graph out
+                createSession(modelpath, GraphOptimizationLevel::ORT_ENABLE_ALL, {});
+        }
+
+        Ort::AllocatorWithDefaultOptions allocator;
+        for (std::size_t i = 0; i < m_session.GetInputCount(); ++i)
+            m_inputNames.emplace_back(m_session.GetInputNameAllocated(i, allocator).get());
+        for (std::size_t i = 0; i < m_session.GetOutputCount(); ++i)
+            m_outputNames.emplace_back(m_session.GetOutputNameAllocated(i, allocator).get());
+        if (1 != m_inputNames.size())
+            throw std::runtime_error("OnnxRuntimeBackend: Model must have exactly one input");
+        for (const auto& name : m_outputNames)
+            m_outputNamePtrs.push_back(name.c_str());
+    }
+
+    Type type() const noexcept override
+    {
+        return Type::OnnxRuntime;
+    }
+
+    void infer(const cv::Mat& blob, std::vector<cv::Mat>& outputs) override
+    {
+        const auto shape = blobShape(blob);
+        const char* inputName = m_inputNames[0].c_str();
+        auto input = Ort::Value::CreateTensor<float>(
+            m_memoryInfo, const_cast<float*>(blob.ptr<float>()), blob.total(), shape.data(), shape.size());
+
+        /* Infer, output values own the memory the returned matrices point to */
+        m_outputValues = m_session.Run(
+            Ort::RunOptions { nullptr }, &inputName, &input, 1, m_outputNamePtrs.data(), m_outputNamePtrs.size());
+
+        outputs.resize(m_outputValues.size());
+        for (std::size_t i = 0; i < m_outputValues.size(); ++i)
+        {
+            const auto outputShape = m_outputValues[i].GetTensorTypeAndShapeInfo().GetShape();
+            const std::vector<int> sizes(outputShape.begin(), outputShape.end());
+            outputs[i] = cv::Mat(sizes.size(), sizes.data(), CV_32F, m_outputValues[i].GetTensorMutableData<float>());
+        }
+    }
+
+private:
+    Ort::Env m_env;
+    Ort::MemoryInfo m_memoryInfo;
+    Ort::Session m_session { nullptr };
+    std::vector<std::string> m_inputNames;
+    std::vector<std::string> m_outputNames;
+    std::vector<const char*> m_outputNamePtrs;
+    std::vector<Ort::Value> m_outputValues;
+};
+#endif
+
+}
+
+InferenceBackend::~InferenceBackend() = default;
+
+InferenceBackend::Type InferenceBackend::parseType(const std::string& type)
+{
+    if ("opencv" == type)
+        return Type::OpenCvDnn;
+    if ("openvino" == type)
+        return Type::OpenVino;
+    if ("torch" == type)
+        return Type::LibTorch;
+    if ("onnxruntime" == type)
+        return Type::OnnxRuntime;
+    throw std::runtime_error("InferenceBackend::parseType: Unknown backend " + type);
+}
+
+const char* InferenceBackend::typeName(Type type) noexcept
+{
+    switch (type)
+    {
+    case Type::OpenCvDnn:
+        return "opencv";
+    case Type::OpenVino:
+        return "openvino";
+    case Type::LibTorch:
+        return "torch";
+    case Type::OnnxRuntime:
+        return "onnxruntime";
+    }
+    return "unknown";
+}
+
+bool InferenceBackend::isAvailable(Type type)
+{
+    switch (type)
+    {
+    case Type::OpenCvDnn:
+    case Type::LibTorch:
+        return true;
+    case Type::OpenVino:
+    {
+        const auto backends = cv::dnn::getAvailableBackends();
+        return std::any_of(backends.begin(), backends.end(),
+            [](const auto& backend) { return cv::dnn::DNN_BACKEND_INFERENCE_ENGINE == backend.first; });
+    }
+    case Type::OnnxRuntime:
+#ifdef WITH_ONNXRUNTIME
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+bool InferenceBackend::needsTorchScript(Type type) noexcept
+{
+    return Type::LibTorch == type;
+}
+
+std::unique_ptr<InferenceBackend> InferenceBackend::create(Type type, const fs::path& modelpath, const Options& options)
+{
+    if (!isAvailable(type))
+        throw std::runtime_error(std::string("InferenceBackend::create: Backend is not available in this build: ") + typeName(type));
+
+    switch (type)
+    {
+    case Type::OpenCvDnn:
+    case Type::OpenVino:
+        try
+        {
+            return std::make_unique<OpenCvDnnBackend>(modelpath, options, Type::OpenVino == type);
+        }
+        catch(const cv::Exception& e)
+        {
+            throw std::runtime_error(std::string("OpenCvDnnBackend: Could not read model:\n") + e.what());
+        }
+    case Type::LibTorch:
+        return std::make_unique<LibTorchBackend>(modelpath, options);
+    case Type::OnnxRuntime:
+#ifdef WITH_ONNXRUNTIME
+        return std::make_unique<OnnxRuntimeBackend>(modelpath, options);
+#else
+        break;
+#endif
+    }
+    throw std::runtime_error("InferenceBackend::create: Unknown backend");
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include <opencv2/core.hpp>
+
+/**
+ * @brief Runtime that executes a network on a float NCHW blob.
+ * Model contract is the same for every backend: one CV_32F input blob in, network outputs as dense CV_32F
+ * matrices of the original shapes out. Output matrices may point into backend memory and stay valid until next infer().
+ */
+class InferenceBackend
+{
+public:
+
+    enum class Type
+    {
+        OpenCvDnn,      // cv::dnn with default (or CUDA) backend, ONNX / Darknet / Caffe / ... model files
+        OpenVino,       // cv::dnn with Inference Engine backend on CPU, needs OpenCV built with OpenVINO
+        LibTorch,       // TorchScript model files
+        OnnxRuntime     // ONNX model files, needs build with ENABLE_ONNXRUNTIME
+    };
+
+    struct Options
+    {
+        bool enableGpu { false };
+        bool optimize { true };     // graph optimizations: freeze + optimize_for_inference (LibTorch), ORT_ENABLE_ALL (ONNX Runtime)
+        bool bfloat16 { false };    // LibTorch only: cast weights and input to bfloat16
+        bool quantized { false };   // LibTorch only: statically quantized model, CPU only
+        int intraOpThreads { 0 };   // threads per operator, 0 keeps runtime default. LibTorch applies it on the inferring thread
+        int interOpThreads { 0 };   // inter-op pool size, 0 keeps runtime default. Process-wide for LibTorch, settable once
+        fs::path cacheDir;          // optimized model is saved here and reused while newer than the source model (empty - off)
+    };
+
+    /**
+     * @brief Parses "opencv", "openvino", "torch" or "onnxruntime". Throws std::runtime_error on unknown value.
+     */
+    static Type parseType(const std::string& type);
+    static const char* typeName(Type type) noexcept;
+
+    /**
+     * @brief Whether this build (and OpenCV build) can run the backend.
+     */
+    static bool isAvailable(Type type);
+
+    /**
+     * @brief Whether the backend reads TorchScript model files rather than ONNX ones.
+     */
+    static bool needsTorchScript(Type type) noexcept;
+
+    /**
+     * @brief Loads the model. Throws std::runtime_error if the backend is not available or the model can not be read.
+     */
+    static std::unique_ptr<InferenceBackend> create(Type type, const fs::path& modelpath, const Options& options);
+
+    virtual ~InferenceBackend();
+
+    virtual Type type() const noexcept = 0;
+
+    /**
+     * @brief Runs the network on a continuous CV_32F N x C x H x W blob.
+     */
+    virtual void infer(const cv::Mat& blob, std::vector<cv::Mat>& outputs) = 0;
+};
@@ -0,0 +1,111 @@
+#include <random>
+#include <string>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const fs::path& filepath)
+{
+    m_fileHandle = CreateFileW(
+        filepath.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, // lets replaceFile() rename over it
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (INVALID_HANDLE_VALUE == m_fileHandle)
+        throw std::runtime_error("MappedFile: Could not open " + filepath.string());
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_fileHandle, &fileSize) || 0 == fileSize.QuadPart)
+    {
+        CloseHandle(m_fileHandle);
+        throw std::runtime_error("MappedFile: Empty or unreadable file " + filepath.string());
+    }
+    m_size = static_cast<std::size_t>(fileSize.QuadPart);
+
+    m_mappingHandle = CreateFileMappingW(m_fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (nullptr == m_mappingHandle)
+    {
+        CloseHandle(m_fileHandle);
+        throw std::runtime_error("MappedFile: Could not map " + filepath.string());
+    }
+    m_data = static_cast<const unsigned char*>(MapViewOfFile(m_mappingHandle, FILE_MAP_READ, 0, 0, 0));
+    if (nullptr == m_data)
+    {
+        CloseHandle(m_mappingHandle);
+        CloseHandle(m_fileHandle);
+        throw std::runtime_error("MappedFile: Could not map " + filepath.string());
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mappingHandle);
+    CloseHandle(m_fileHandle);
+}
+
+#else
+
+MappedFile::MappedFile(const fs::path& filepath)
+{
+    const int fd = ::open(filepath.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("MappedFile: Could not open " + filepath.string());
+
+    struct stat fileStat;
+    if (0 != ::fstat(fd, &fileStat) || 0 == fileStat.st_size)
+    {
+        ::close(fd);
+        throw std::runtime_error("MappedFile: Empty or unreadable file " + filepath.string());
+    }
+    m_size = static_cast<std::size_t>(fileStat.st_size);
+
+    void* mapped = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // mapping keeps its own reference to the file
+    if (MAP_FAILED == mapped)
+        throw std::runtime_error("MappedFile: Could not map " + filepath.string());
+    m_data = static_cast<const unsigned char*>(mapped);
+}
+
+MappedFile::~MappedFile()
+{
+    ::munmap(const_cast<unsigned char*>(m_data), m_size);
+}
+
+#endif
+
+const unsigned char* MappedFile::data() const noexcept
+{
+    return m_data;
+}
+
+std::size_t MappedFile::size() const noexcept
+{
+    return m_size;
+}
+
+void replaceFile(const fs::path& filepath, const std::function<void(const fs::path& tmpPath)>& write)
+{
+    const auto tmpPath = fs::path(filepath).concat(".tmp" + std::to_string(std::random_device()()));
+    try
+    {
+        write(tmpPath);
+        fs::rename(tmpPath, filepath);
+    }
+    catch(...)
+    {
+        std::error_code error;
+        fs::remove(tmpPath, error);
+        throw;
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+/**
+ * @brief Read-only memory mapping of a whole file.
+ * Pages are loaded lazily by the OS and shared between all processes mapping the same file.
+ */
+class MappedFile final
+{
+public:
+
+    /**
+     * @brief Maps the file. Throws std::runtime_error on failure.
+     */
+    explicit MappedFile(const fs::path& filepath);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const noexcept;
+    std::size_t size() const noexcept;
+
+private:
+    const unsigned char* m_data { nullptr };
+    std::size_t m_size { 0 };
+#ifdef _WIN32
+    void* m_fileHandle { nullptr };
+    void* m_mappingHandle { nullptr };
+#endif
+};
+
+/**
+ * @brief Writes a file through write(tmpPath) into a temporary file next to it, then renames it over filepath.
+ * Processes that have the old file mapped keep their pages intact, new readers get the complete new file.
+ * The temporary file is removed and the exception rethrown if write() throws.
+ */
+void replaceFile(const fs::path& filepath, const std::function<void(const fs::path& tmpPath)>& write);
@@ -1,6 +1,7 @@
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <stdexcept>
+#include <algorithm>
 
 #include <opencv2/imgproc.hpp>
 
@@ -111,7 +112,39 @@ std::vector<float> avgEmbedding(const Matr& embeddings)
     return result;
 }
 
-double getAngleBetweenEyes(const std::vector<int>& landmarks)
+Matr selectExemplars(const Matr& embeddings, int maxCount)
+{
+    const int nEmbeddings = embeddings.size();
+    if (nEmbeddings <= maxCount)
+        return embeddings;
+    if (maxCount <= 0)
+        return {};
+
+    const auto centroid = avgEmbedding(embeddings);
+    std::vector<float> closestSim(nEmbeddings); // similarity to the nearest selected exemplar
+    for (int i = 0; i < nEmbeddings; ++i)
+        closestSim[i] = cosineSimilarity(embeddings[i], centroid);
+
+    Matr result;
+    result.reserve(maxCount);
+    std::vector<bool> selected(nEmbeddings, false);
+    while (result.size() < maxCount)
+    {
+        int farthest = -1;
+        for (int i = 0; i < nEmbeddings; ++i)
+            if (!selected[i] && (farthest < 0 || closestSim[i] < closestSim[farthest]))
+                farthest = i;
+
+        selected[farthest] = true;
+        result.push_back(embeddings[farthest]);
+        for (int i = 0; i < nEmbeddings; ++i)
+            if (!selected[i])
+                closestSim[i] = std::max(closestSim[i], cosineSimilarity(embeddings[i], embeddings[farthest]));
+    }
+    return result;
+}
+
+double getAngleBetweenEyes(const Landmarks& landmarks)
 {
     const cv::Point leftEye(landmarks[0], landmarks[1]);
     const cv::Point rightEye(landmarks[2], landmarks[3]);
@@ -128,7 +161,7 @@ double getAngleBetweenEyes(const std::vector<int>& landmarks)
 
 cv::RotatedRect getFaceRotatedBoundingBox(
     const cv::Mat& image, cv::Rect faceBoundingBox, 
-    const std::vector<int>& landmarks, const cv::Point2f refPoints3[3])
+    const Landmarks& landmarks, const cv::Point2f refPoints3[3])
 {
     const cv::Point leftEye(landmarks[0], landmarks[1]);
     const cv::Point rightEye(landmarks[2], landmarks[3]);
@@ -165,15 +198,13 @@ cv::RotatedRect getFaceRotatedBoundingBox(
 }
 
 cv::Mat alignFace2(
-    const cv::Mat& image, cv::Rect faceBoundingBox, const std::vector<int>& landmarks, 
+    const cv::Mat& image, cv::Rect faceBoundingBox, const Landmarks& landmarks, 
     cv::Size cropSize, const cv::Point2f refPoints3[3])
 {
     if (image.empty())
         throw std::runtime_error("alignFace2: Empty image");
     if (faceBoundingBox.empty())
         throw std::runtime_error("alignFace2: Empty faceBoundingBox");
-    if (landmarks.size() < 2)
-        throw std::runtime_error("alignFace2: Missing landmark coordinates");
 
     const cv::Point leftEye(landmarks[0], landmarks[1]);
     const cv::Point rightEye(landmarks[2], landmarks[3]);
@@ -206,7 +237,7 @@ cv::Mat alignFace2(
 }
 
 cv::Mat alignFace3(
-    const cv::Mat& image, cv::Rect faceBoundingBox, const std::vector<int>& landmarks, cv::Size cropSize, 
+    const cv::Mat& image, cv::Rect faceBoundingBox, const Landmarks& landmarks, cv::Size cropSize, 
     const cv::Point2f refPoints3[3])
 {
     if (image.empty())
@@ -232,6 +263,15 @@ cv::Mat alignFace3(
 }
 
 
+cv::Rect expandRect(cv::Rect rect, float scale, cv::Rect bounds)
+{
+    const float w = rect.width * scale;
+    const float h = rect.height * scale;
+    const float cx = rect.x + 0.5f * rect.width;
+    const float cy = rect.y + 0.5f * rect.height;
+    return cv::Rect(cvRound(cx - 0.5f * w), cvRound(cy - 0.5f * h), cvRound(w), cvRound(h)) & bounds;
+}
+
 PeriodicTrigger::PeriodicTrigger(std::int64_t frequency)
     : m_frequency(frequency)
 {}
@@ -256,4 +296,85 @@ bool PeriodicTrigger::rocknroll(std::int64_t now)
 
     m_lastTriggered = now - (now % m_frequency);
     return true;
+}
+
+AdaptiveTrigger::AdaptiveTrigger()
+    : AdaptiveTrigger(Params())
+{}
+
+AdaptiveTrigger::AdaptiveTrigger(Params params)
+    : m_params(params)
+{
+    if (m_params.minPeriodMs < 0 || m_params.maxPeriodMs < m_params.minPeriodMs)
+        throw std::runtime_error("AdaptiveTrigger::AdaptiveTrigger: Invalid period range");
+    if (m_params.targetFps <= 0.0f || m_params.cpuBudget <= 0.0f)
+        throw std::runtime_error("AdaptiveTrigger::AdaptiveTrigger: targetFps and cpuBudget must be positive");
+}
+
+AdaptiveTrigger::~AdaptiveTrigger() = default;
+
+bool AdaptiveTrigger::rocknroll(std::int64_t now)
+{
+    if (-1 != m_lastTriggered && now - m_lastTriggered < period())
+        return false;
+
+    m_lastTriggered = now;
+    return true;
+}
+
+void AdaptiveTrigger::reportFrame(double frameMs, double detectionMs)
+{
+    constexpr double Smoothing = 0.1;
+    const auto smooth = [](double& average, double value)
+    {
+        average = (0.0 == average) ? value : average + Smoothing * (value - average);
+    };
+
+    if (detectionMs > 0.0)
+        smooth(m_detectionMs, detectionMs);
+    smooth(m_otherMs, std::max(0.0, frameMs - detectionMs));
+}
+
+void AdaptiveTrigger::reportTrack(float uncertainty, float speed)
+{
+    m_tracking = true;
+    m_uncertainty = uncertainty;
+    m_speed = speed;
+}
+
+void AdaptiveTrigger::resetTrack() noexcept
+{
+    m_tracking = false;
+}
+
+std::int64_t AdaptiveTrigger::period() const
+{
+    const auto minPeriod = static_cast<double>(m_params.minPeriodMs);
+    const auto maxPeriod = static_cast<double>(m_params.maxPeriodMs);
+
+    /* Track: detect before the prediction may drift off by maxDrift */
+    double period = m_params.basePeriodMs;
+    if (m_tracking)
+    {
+        const double driftLeft = m_params.maxDrift - m_uncertainty;
+        const double frameMs = (m_otherMs > 0.0) ? m_otherMs : 1000.0 / m_params.targetFps;
+        const double speedPerMs = m_speed / frameMs;
+        if (driftLeft <= 0.0)
+            period = minPeriod;
+        else if (speedPerMs > 0.0)
+            period = driftLeft / speedPerMs;
+        else
+            period = maxPeriod;
+    }
+    period = std::clamp(period, minPeriod, maxPeriod);
+
+    /* Load: detection gets at most cpuBudget of the frame time left by the rest of the pipeline */
+    if (m_detectionMs > 0.0)
+    {
+        const double frameBudgetMs = 1000.0 / m_params.targetFps;
+        const double share = std::min<double>(m_params.cpuBudget, 1.0 - m_otherMs / frameBudgetMs);
+        const double loadPeriod = (share > 0.0) ? m_detectionMs / share : maxPeriod; // falling behind anyway
+        period = std::max(period, loadPeriod);
+    }
+    return static_cast<std::int64_t>(std::min(period, maxPeriod));
 }
\ No newline at end of file
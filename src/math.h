@@ -1,10 +1,12 @@
 #pragma once
 
+#include <array>
 #include <vector>
 #include <utility>
 #include <opencv2/core.hpp>
 
 using Matr = std::vector<std::vector<float>>;
+using Landmarks = std::array<int, 10>; // x1, y1, ..., x5, y5: eyes, nose, mouth corners
 
 template<typename T>
 cv::Mat vec2mat(const std::vector<std::vector<T>>& vec);
@@ -18,11 +20,17 @@ std::pair<int, float> searchMostSimilarEmbedding(
 
 std::vector<float> avgEmbedding(const Matr& embeddings);
 
-double getAngleBetweenEyes(const std::vector<int>& landmarks);
+/**
+ * @brief Picks up to maxCount embeddings that cover the person's appearance (poses, lighting) best.
+ * Greedy farthest-point traversal in cosine distance, starting from the embedding least similar to the centroid.
+ */
+Matr selectExemplars(const Matr& embeddings, int maxCount);
+
+double getAngleBetweenEyes(const Landmarks& landmarks);
 
 cv::RotatedRect getFaceRotatedBoundingBox(
     const cv::Mat& image, cv::Rect faceBoundingBox, 
-    const std::vector<int>& landmarks, const cv::Point2f refPoints3[3]);
+    const Landmarks& landmarks, const cv::Point2f refPoints3[3]);
 
 /** 
  * @brief Align face using eye points. Rotate, scale and translate face so that the eyes lie on a horizontal line. 
@@ -35,7 +43,7 @@ cv::RotatedRect getFaceRotatedBoundingBox(
     @param refPoints3 Controls how much of the face is visible after preprocessing
  */
 cv::Mat alignFace2(
-    const cv::Mat& image, cv::Rect faceBoundingBox, const std::vector<int>& landmarks, 
+    const cv::Mat& image, cv::Rect faceBoundingBox, const Landmarks& landmarks, 
     cv::Size cropSize, const cv::Point2f refPoints3[3]);
 
 /** 
@@ -45,10 +53,16 @@ cv::Mat alignFace2(
     @param refPoints3 Reference points for calculating affine Transformation
  */
 cv::Mat alignFace3(
-    const cv::Mat& image, cv::Rect faceBoundingBox, const std::vector<int>& landmarks, cv::Size cropSize, 
+    const cv::Mat& image, cv::Rect faceBoundingBox, const Landmarks& landmarks, cv::Size cropSize, 
     const cv::Point2f refPoints3[3]);
 
 
+/**
+ * @brief Scales rect around its center, e.g. to search for a tracked face around its predicted box. Clipped by bounds.
+ */
+cv::Rect expandRect(cv::Rect rect, float scale, cv::Rect bounds);
+
+
 class PeriodicTrigger final
 {
 public:
@@ -60,4 +74,59 @@ public:
 private:
     std::int64_t m_frequency { -1 };
     std::int64_t m_lastTriggered { -1 };
+};
+
+/**
+ * @brief Detection trigger with a period picked at runtime instead of a fixed one.
+ * Detects sooner while the tracked box is uncertain or moving fast and later while it is steady,
+ * but never more often than the measured detector latency allows for the target frame rate and CPU budget.
+ */
+class AdaptiveTrigger final
+{
+public:
+
+    struct Params
+    {
+        std::int64_t basePeriodMs { 500 };  // period while nothing is tracked
+        std::int64_t minPeriodMs { 50 };
+        std::int64_t maxPeriodMs { 2000 };
+        float targetFps { 25.0f };          // frame rate to hold
+        float cpuBudget { 0.5f };           // max share of frame time spent in detection
+        float maxDrift { 0.25f };           // track error allowed between detections, in box sizes
+    };
+
+    AdaptiveTrigger();
+    explicit AdaptiveTrigger(Params params);
+    ~AdaptiveTrigger();
+
+    bool rocknroll(std::int64_t now);
+
+    /**
+     * @brief Feeds the measured time of a whole frame and of the detection in it (0 if there was none), msec.
+     */
+    void reportFrame(double frameMs, double detectionMs);
+
+    /**
+     * @brief Feeds the tracker state: position std-dev and speed (per frame), both in box sizes.
+     */
+    void reportTrack(float uncertainty, float speed);
+
+    /**
+     * @brief Forgets the track, e.g. when it is lost. Period falls back to basePeriodMs.
+     */
+    void resetTrack() noexcept;
+
+    /**
+     * @brief Current detection period, msec.
+     */
+    std::int64_t period() const;
+
+private:
+    Params m_params;
+    std::int64_t m_lastTriggered { -1 };
+    double m_detectionMs { 0.0 };   // smoothed detector latency
+    double m_otherMs { 0.0 };       // smoothed frame time without detection
+    bool m_tracking { false };
+    float m_uncertainty { 0.0f };
+    float m_speed { 0.0f };
 };
\ No newline at end of file
@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include <opencv2/imgproc.hpp>
+
+#include "motion_gate.h"
+#include "math.h"
+
+MotionGate::MotionGate()
+    : MotionGate(Params())
+{}
+
+MotionGate::MotionGate(Params params)
+    : m_params(params)
+{}
+
+MotionGate::~MotionGate() = default;
+
+bool MotionGate::update(const cv::Mat& frame, std::int64_t now)
+{
+    if (frame.empty())
+        throw std::runtime_error("MotionGate::update: Given empty frame");
+
+    /* Small blurred grayscale copy: cheap to compare and insensitive to sensor noise */
+    const double scale = std::min(1.0, static_cast<double>(m_params.analysisWidth) / frame.cols);
+    cv::resize(frame, m_small, cv::Size(), scale, scale, cv::INTER_AREA);
+    if (3 == m_small.channels())
+        cv::cvtColor(m_small, m_gray, cv::COLOR_BGR2GRAY);
+    else
+        m_small.copyTo(m_gray);
+    cv::GaussianBlur(m_gray, m_gray, cv::Size(5, 5), 0.0);
+
+    const cv::Rect frameRect(cv::Point(), frame.size());
+    const bool firstFrame = m_previous.empty() || m_previous.size() != m_gray.size();
+    if (!firstFrame)
+    {
+        cv::absdiff(m_gray, m_previous, m_diff);
+        cv::threshold(m_diff, m_mask, m_params.pixelThreshold, 255, cv::THRESH_BINARY);
+    }
+    std::swap(m_previous, m_gray);
+
+    if (firstFrame || now - m_lastFullFrame >= m_params.fullFrameEveryMs)
+    {
+        m_region = frameRect;
+        m_lastFullFrame = now;
+        return true;
+    }
+
+    if (cv::countNonZero(m_mask) < m_params.minMotionFraction * m_mask.total())
+    {
+        m_region = cv::Rect();
+        return false;
+    }
+
+    /* Bounding box of changed pixels, back in frame coordinates */
+    const cv::Rect motion = cv::boundingRect(m_mask);
+    const cv::Rect frameMotion(
+        cvFloor(motion.x / scale), cvFloor(motion.y / scale), cvCeil(motion.width / scale), cvCeil(motion.height / scale));
+    m_region = expandRect(frameMotion, 1.0f + 2.0f * m_params.regionMargin, frameRect);
+    if (m_region.area() > m_params.maxRegionFraction * frameRect.area())
+    {
+        m_region = frameRect;
+        m_lastFullFrame = now;
+    }
+    return true;
+}
+
+cv::Rect MotionGate::region() const noexcept
+{
+    return m_region;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+#include <opencv2/core.hpp>
+
+/**
+ * @brief Decides whether a frame is worth running the detector on.
+ * Downscaled grayscale frame is compared with the one checked before: static scenes are skipped,
+ * active ones are searched only inside the bounding box of changed pixels.
+ */
+class MotionGate final
+{
+public:
+
+    struct Params
+    {
+        int analysisWidth { 160 };          // frames are downscaled to this width before differencing
+        int pixelThreshold { 16 };          // gray level change counted as motion
+        float minMotionFraction { 0.002f }; // fraction of changed pixels needed to run detection
+        float regionMargin { 0.25f };       // motion box grown by this fraction of its size on every side
+        float maxRegionFraction { 0.5f };   // larger motion boxes are replaced by the whole frame
+        std::int64_t fullFrameEveryMs { 5000 }; // whole frame is searched at least this often (people standing still)
+    };
+
+    MotionGate();
+    explicit MotionGate(Params params);
+    ~MotionGate();
+
+    /**
+     * @brief Compares frame with the previously checked one. Returns false if the scene is static.
+     */
+    bool update(const cv::Mat& frame, std::int64_t now);
+
+    /**
+     * @brief Part of the last frame to run detection on: motion box, whole frame, or empty if update() returned false.
+     */
+    cv::Rect region() const noexcept;
+
+private:
+    Params m_params;
+    cv::Mat m_small;
+    cv::Mat m_gray;
+    cv::Mat m_previous;
+    cv::Mat m_diff;
+    cv::Mat m_mask;
+    cv::Rect m_region;
+    std::int64_t m_lastFullFrame { 0 };
+};
@@ -58,7 +58,7 @@ void renderLandmarks(cv::Mat& out, std::vector<std::vector<int>> landmarks)
 
 void renderFaces(cv::Mat& out, std::vector<Face> faces)
 {
-    for (const auto face : faces)
+    for (const auto& face : faces)
     {
         if (face.boundingBox.empty())
             continue;
@@ -67,9 +67,9 @@ void renderFaces(cv::Mat& out, std::vector<Face> faces)
         renderBorderedBoundingBox(out, face.boundingBox);
 
         // Landmarks
-        if (10 == face.landmarks.size())
+        if (face.landmarks)
             for (int i = 0; i < 5; ++i)
-                cv::circle(out, cv::Point(face.landmarks[2 * i], face.landmarks[2 * i + 1]), 1, FaceColor, -1);
+                cv::circle(out, cv::Point((*face.landmarks)[2 * i], (*face.landmarks)[2 * i + 1]), 1, FaceColor, -1);
 
         // Person name
         cv::Scalar nameColor = ("unknown" != face.name) ? FaceColor : cv::Scalar(0, 0, 255); 
@@ -100,14 +100,14 @@ void renderFaces(cv::Mat& out, std::vector<Face> faces)
 
         // Render roll circle
         
-        if (10 == face.landmarks.size())
+        if (face.landmarks)
         {
             const int radius = 25;
             origin += (2 * offset);
             const cv::Point circleCenter = origin + cv::Point(radius, 0);
             cv::circle(out, circleCenter, radius, FaceColor, 2);
 
-            const float faceRoll = getAngleBetweenEyes(face.landmarks) * M_PI/180.0;
+            const float faceRoll = getAngleBetweenEyes(*face.landmarks) * M_PI/180.0;
             const cv::Matx22f R( std::cos(faceRoll), -std::sin(faceRoll), std::sin(faceRoll), std::cos(faceRoll) );
             const cv::Vec2f v = R * cv::Vec2f(0.0f, 1.0f); // (unit-length)
             const cv::Point pt1 = circleCenter;
@@ -117,6 +117,16 @@ void renderFaces(cv::Mat& out, std::vector<Face> faces)
                 out, cv::format("roll: %.1f", faceRoll  * 180.0/M_PI), 
                 origin += (2.5 * offset), cv::FONT_HERSHEY_PLAIN, 1.2, FaceColor, 1);
         }
+
+        // Top candidates under the bounding box
+        if (face.candidates.size() > 1)
+        {
+            cv::Point candidateOrigin = face.boundingBox.tl() + cv::Point(0, face.boundingBox.height);
+            for (const auto& [candidateName, candidateSimilarity] : face.candidates)
+                cv::putText(
+                    out, cv::format("%s: %.2f", candidateName.c_str(), candidateSimilarity), 
+                    candidateOrigin += offset, cv::FONT_HERSHEY_PLAIN, 1.0, FaceColor, 1);
+        }
     }
 }
 
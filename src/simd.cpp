@@ -0,0 +1,287 @@
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "simd.h"
+
+namespace
+{
+
+#if defined(__AVX2__) && defined(__FMA__)
+inline float hsum256(__m256 v)
+{
+    const __m128 lo = _mm256_castps256_ps128(v);
+    const __m128 hi = _mm256_extractf128_ps(v, 1);
+    __m128 s = _mm_add_ps(lo, hi);
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 0x55));
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+inline float halfToFloat(std::uint16_t h)
+{
+    const std::uint32_t sign = static_cast<std::uint32_t>(h & 0x8000) << 16;
+    std::uint32_t exponent = (h >> 10) & 0x1F;
+    std::uint32_t mantissa = h & 0x3FF;
+
+    std::uint32_t bits;
+    if (0 == exponent)
+    {
+        if (0 == mantissa)
+        {
+            bits = sign;
+        }
+        else // subnormal: renormalize
+        {
+            exponent = 127 - 15 + 1;
+            while (0 == (mantissa & 0x400))
+            {
+                mantissa <<= 1;
+                --exponent;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+        }
+    }
+    else if (0x1F == exponent) // inf / nan
+    {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else
+    {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+}
+
+float simdDot(const float* a, const float* b, std::size_t n)
+{
+    std::size_t i = 0;
+    float result = 0.0f;
+
+#if defined(__AVX512F__)
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    for (; i + 32 <= n; i += 32)
+    {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16)
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    result = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+#elif defined(__AVX2__) && defined(__FMA__)
+    // 4 independent accumulators hide FMA latency
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+    for (; i + 32 <= n; i += 32)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+    }
+    for (; i + 8 <= n; i += 8)
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    result = hsum256(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+#else
+    float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (; i + 4 <= n; i += 4)
+    {
+        acc[0] += a[i] * b[i];
+        acc[1] += a[i + 1] * b[i + 1];
+        acc[2] += a[i + 2] * b[i + 2];
+        acc[3] += a[i + 3] * b[i + 3];
+    }
+    result = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+
+    for (; i < n; ++i)
+        result += a[i] * b[i];
+    return result;
+}
+
+float simdDotF16(const float* a, const std::uint16_t* b, std::size_t n)
+{
+    std::size_t i = 0;
+    float result = 0.0f;
+
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m512 bf = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), bf, acc);
+    }
+    result = _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m256 b0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        const __m256 b1 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), b0, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), b1, acc1);
+    }
+    result = hsum256(_mm256_add_ps(acc0, acc1));
+#endif
+
+    for (; i < n; ++i)
+        result += a[i] * halfToFloat(b[i]);
+    return result;
+}
+
+std::int32_t simdDotInt8(const std::int8_t* a, const std::int8_t* b, std::size_t n)
+{
+    std::size_t i = 0;
+    std::int32_t result = 0;
+
+#if defined(__AVX512BW__)
+    __m512i acc = _mm512_setzero_si512();
+    for (; i + 32 <= n; i += 32)
+    {
+        const __m512i a16 = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)));
+        const __m512i b16 = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(a16, b16));
+    }
+    result = _mm512_reduce_add_epi32(acc);
+#elif defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m256i a16 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        const __m256i b16 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a16, b16));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    result = _mm_cvtsi128_si32(s);
+#endif
+
+    for (; i < n; ++i)
+        result += static_cast<std::int32_t>(a[i]) * b[i];
+    return result;
+}
+
+float simdQuantizeInt8(const float* v, std::int8_t* out, std::size_t n)
+{
+    float maxAbs = 0.0f;
+    for (std::size_t i = 0; i < n; ++i)
+        maxAbs = std::max(maxAbs, std::abs(v[i]));
+    if (maxAbs <= 0.0f)
+    {
+        std::fill(out, out + n, 0);
+        return 0.0f;
+    }
+
+    const float scale = maxAbs / 127.0f;
+    const float invScale = 1.0f / scale;
+    for (std::size_t i = 0; i < n; ++i)
+        out[i] = static_cast<std::int8_t>(std::lrint(std::clamp(v[i] * invScale, -127.0f, 127.0f)));
+    return scale;
+}
+
+void simdNormalize(float* v, std::size_t n)
+{
+    const float sqNorm = simdDot(v, v, n);
+    if (sqNorm <= 0.0f)
+        return;
+
+    const float invNorm = 1.0f / std::sqrt(sqNorm);
+    for (std::size_t i = 0; i < n; ++i)
+        v[i] *= invNorm;
+}
+
+std::size_t simdSelectStrided(
+    const float* data, std::size_t count, std::size_t stride, float threshold, std::int32_t* indices)
+{
+    std::size_t i = 0;
+    std::size_t n = 0;
+
+#if defined(__AVX512F__)
+    const __m512i offsets = _mm512_mullo_epi32(
+        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(static_cast<int>(stride)));
+    const __m512 thresholds = _mm512_set1_ps(threshold);
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m512 values = _mm512_i32gather_ps(offsets, data + i * stride, sizeof(float));
+        unsigned mask = _mm512_cmp_ps_mask(values, thresholds, _CMP_GE_OQ);
+        for (int lane = 0; 0 != mask; ++lane, mask >>= 1)
+            if (mask & 1)
+                indices[n++] = static_cast<std::int32_t>(i + lane);
+    }
+#elif defined(__AVX2__)
+    const __m256i offsets = _mm256_mullo_epi32(
+        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(static_cast<int>(stride)));
+    const __m256 thresholds = _mm256_set1_ps(threshold);
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256 values = _mm256_i32gather_ps(data + i * stride, offsets, sizeof(float));
+        unsigned mask = _mm256_movemask_ps(_mm256_cmp_ps(values, thresholds, _CMP_GE_OQ));
+        for (int lane = 0; 0 != mask; ++lane, mask >>= 1)
+            if (mask & 1)
+                indices[n++] = static_cast<std::int32_t>(i + lane);
+    }
+#endif
+
+    for (; i < count; ++i)
+        if (data[i * stride] >= threshold)
+            indices[n++] = static_cast<std::int32_t>(i);
+    return n;
+}
+
+const char* simdKernelName() noexcept
+{
+    /* Conditions mirror the #if chains of the kernels above: each kernel picks its own path */
+#if defined(__AVX512F__)
+#define FR_DOT_KERNEL "avx512"
+#elif defined(__AVX2__) && defined(__FMA__)
+#define FR_DOT_KERNEL "avx2"
+#else
+#define FR_DOT_KERNEL "scalar"
+#endif
+
+#if defined(__AVX512F__)
+#define FR_F16_KERNEL "avx512"
+#elif defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+#define FR_F16_KERNEL "avx2"
+#else
+#define FR_F16_KERNEL "scalar"
+#endif
+
+#if defined(__AVX512BW__)
+#define FR_INT8_KERNEL "avx512"
+#elif defined(__AVX2__)
+#define FR_INT8_KERNEL "avx2"
+#else
+#define FR_INT8_KERNEL "scalar"
+#endif
+
+#if defined(__AVX512F__)
+#define FR_SELECT_KERNEL "avx512"
+#elif defined(__AVX2__)
+#define FR_SELECT_KERNEL "avx2"
+#else
+#define FR_SELECT_KERNEL "scalar"
+#endif
+
+    return "dot " FR_DOT_KERNEL ", f16 " FR_F16_KERNEL ", int8 " FR_INT8_KERNEL ", select " FR_SELECT_KERNEL;
+
+#undef FR_DOT_KERNEL
+#undef FR_F16_KERNEL
+#undef FR_INT8_KERNEL
+#undef FR_SELECT_KERNEL
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Dot product of two float vectors of length n.
+ * Dispatched at compile time to AVX-512 / AVX2+FMA kernels when the target supports them,
+ * otherwise falls back to scalar code. Pointers do not have to be aligned.
+ */
+float simdDot(const float* a, const float* b, std::size_t n);
+
+/**
+ * @brief Dot product of float vector and IEEE half-precision vector (F16C conversion when available).
+ */
+float simdDotF16(const float* a, const std::uint16_t* b, std::size_t n);
+
+/**
+ * @brief Integer dot product of two int8 vectors (AVX-512BW / AVX2 sign-extending multiply-add).
+ */
+std::int32_t simdDotInt8(const std::int8_t* a, const std::int8_t* b, std::size_t n);
+
+/**
+ * @brief Symmetric per-vector int8 quantization: out = round(v / scale), returns scale = max|v| / 127.
+ */
+float simdQuantizeInt8(const float* v, std::int8_t* out, std::size_t n);
+
+/**
+ * @brief Scales vector to unit L2 norm in place. Zero vectors are left untouched.
+ */
+void simdNormalize(float* v, std::size_t n);
+
+/**
+ * @brief Writes indices i of values data[i * stride] >= threshold to indices (room for count values), returns their number.
+ * Scans strided fields of packed records, e.g. one score per network output cell (AVX-512 / AVX2 gathers).
+ */
+std::size_t simdSelectStrided(
+    const float* data, std::size_t count, std::size_t stride, float threshold, std::int32_t* indices);
+
+/**
+ * @brief Paths selected at compile time for every kernel, e.g. "dot avx2, f16 avx2, int8 avx2, select avx2".
+ */
+const char* simdKernelName() noexcept;
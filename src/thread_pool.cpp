@@ -0,0 +1,123 @@
+#include <atomic>
+#include <stdexcept>
+
+#include "thread_pool.h"
+
+namespace
+{
+
+/* Set while the thread runs a pool job: nested parallelFor() calls run serially instead of deadlocking */
+thread_local bool insideJob { false };
+
+}
+
+ThreadPool::ThreadPool(int nThreads)
+{
+    if (nThreads < 1)
+        throw std::runtime_error("ThreadPool: nThreads must be positive");
+
+    m_workers.reserve(nThreads - 1);
+    for (int i = 1; i < nThreads; ++i)
+        m_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wakeUp.notify_all();
+    for (auto& worker : m_workers)
+        worker.join();
+}
+
+void ThreadPool::parallelFor(int nTasks, const std::function<void(int, int)>& task)
+{
+    if (nTasks <= 0)
+        return;
+    if (m_workers.empty() || 1 == nTasks || insideJob)
+    {
+        for (int i = 0; i < nTasks; ++i)
+            task(i, 0);
+        return;
+    }
+
+    std::atomic<int> nextTask { 0 };
+    run([&nextTask, nTasks, &task](int workerId)
+    {
+        for (int i = nextTask++; i < nTasks; i = nextTask++)
+            task(i, workerId);
+    });
+}
+
+int ThreadPool::size() const noexcept
+{
+    return static_cast<int>(m_workers.size()) + 1;
+}
+
+void ThreadPool::run(const std::function<void(int)>& job)
+{
+    std::lock_guard<std::mutex> runLock(m_runMutex);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_job = &job;
+        m_pending = static_cast<int>(m_workers.size());
+        m_error = nullptr;
+        ++m_generation;
+    }
+    m_wakeUp.notify_all();
+
+    std::exception_ptr callerError;
+    insideJob = true;
+    try
+    {
+        job(0);
+    }
+    catch(...)
+    {
+        callerError = std::current_exception();
+    }
+    insideJob = false;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return 0 == m_pending; });
+    m_job = nullptr;
+    if (callerError)
+        std::rethrow_exception(callerError);
+    if (m_error)
+        std::rethrow_exception(m_error);
+}
+
+void ThreadPool::workerLoop(int workerId)
+{
+    std::uint64_t seenGeneration = 0;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_wakeUp.wait(lock, [this, seenGeneration]() { return m_stopping || m_generation != seenGeneration; });
+        if (m_stopping)
+            return;
+        seenGeneration = m_generation;
+        const auto* job = m_job;
+        lock.unlock();
+
+        std::exception_ptr error;
+        insideJob = true;
+        try
+        {
+            (*job)(workerId);
+        }
+        catch(...)
+        {
+            error = std::current_exception();
+        }
+        insideJob = false;
+
+        lock.lock();
+        if (error && !m_error)
+            m_error = error;
+        if (0 == --m_pending)
+            m_done.notify_one();
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+
+/**
+ * @brief Fixed set of worker threads for short data-parallel jobs (gallery search).
+ * Workers sleep between jobs, so the pool does not compete with LibTorch / OpenCV pools
+ * while the model is running. The calling thread takes part in every job as worker 0.
+ */
+class ThreadPool final
+{
+public:
+
+    /**
+     * @brief nThreads is the total number of threads running a job, including the caller.
+     */
+    explicit ThreadPool(int nThreads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /**
+     * @brief Calls task(taskId, workerId) for every taskId in [0, nTasks) and waits for completion.
+     * Tasks are handed out dynamically, workerId is in [0, size()). Exceptions are rethrown to the caller.
+     * Jobs submitted from several threads are run one after another.
+     */
+    void parallelFor(int nTasks, const std::function<void(int, int)>& task);
+
+    int size() const noexcept;
+
+private:
+    void run(const std::function<void(int)>& job);
+    void workerLoop(int workerId);
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_runMutex;
+
+    /* Current job, guarded by m_mutex */
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::condition_variable m_done;
+    const std::function<void(int)>* m_job { nullptr };
+    std::uint64_t m_generation { 0 };
+    int m_pending { 0 };
+    std::exception_ptr m_error;
+    bool m_stopping { false };
+};